@@ -29,6 +29,7 @@
 
 #include "frame.h"
 #include "memman.h"
+#include "pixfmt.h"
 #include "util.h"
 
 static CMEM_AllocParams cma;
@@ -38,23 +39,27 @@ static int
 cmem_alloc_frames(struct frame_format *ff, unsigned bufsize,
                   struct frame **fr, unsigned *nf)
 {
-    int buf_w = ff->width, buf_h = ff->height;
+    const struct pixfmt *pf = ofbp_get_pixfmt(ff->pixfmt);
     struct frame *frames;
     unsigned num_frames;
     unsigned frame_size;
+    int offs[3], stride[3];
     uint8_t *phys;
-    unsigned y_offset;
-    int i;
+    int i, j;
+
+    if (!pf) {
+        fprintf(stderr, "CMEM: unsupported pixel format %d\n", ff->pixfmt);
+        return -1;
+    }
 
     if (CMEM_init())
         return -1;
 
-    frame_size = buf_w * buf_h * 3 / 2;
+    frame_size = ofbp_get_plane_layout(offs, stride, pf,
+                                       ff->width, ff->height);
     num_frames = MAX(bufsize / frame_size, MIN_FRAMES);
     bufsize = num_frames * frame_size;
 
-    y_offset = buf_w * buf_h;
-
     fprintf(stderr, "CMEM: using %d frame buffers\n", num_frames);
 
     cma.type      = CMEM_HEAP;
@@ -77,19 +82,16 @@ cmem_alloc_frames(struct frame_format *ff, unsigned bufsize,
         uint8_t *pp = phys + i * frame_size;
 
         frames[i].ff = ff;
-        frames[i].virt[0] = p;
-        frames[i].virt[1] = p + y_offset;
-        frames[i].virt[2] = p + y_offset + buf_w / 2;
-        frames[i].phys[0] = pp;
-        frames[i].phys[1] = pp + y_offset;
-        frames[i].phys[2] = pp + y_offset + buf_w / 2;
-        frames[i].linesize[0] = ff->width;
-        frames[i].linesize[1] = ff->width;
-        frames[i].linesize[2] = ff->width;
+        frames[i].fd = -1;
+        for (j = 0; j < 3; j++) {
+            frames[i].virt[j]     = p  + offs[j];
+            frames[i].phys[j]     = pp + offs[j];
+            frames[i].linesize[j] = stride[j];
+        }
     }
 
-    ff->y_stride  = ff->width;
-    ff->uv_stride = ff->width;
+    ff->y_stride  = stride[0];
+    ff->uv_stride = stride[1];
 
     *fr = frames;
     *nf = num_frames;
@@ -26,6 +26,7 @@
 #define OFBP_DISPLAY_H
 
 #include <stdint.h>
+#include <time.h>
 
 #include "frame.h"
 #include "pixconv.h"
@@ -40,6 +41,8 @@ struct display {
                    const struct pixconv *pc, struct frame_format *df);
     void (*prepare)(struct frame *f);
     void (*show)(struct frame *f);
+    void (*flush)(void);
+    int  (*feedback)(struct timespec *flip, unsigned *period);
     void (*close)(void);
     const struct memman *memman;
 };
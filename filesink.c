@@ -0,0 +1,495 @@
+/*
+    Copyright (C) 2011 Mans Rullgard
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+    HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "display.h"
+#include "memman.h"
+#include "pixfmt.h"
+#include "util.h"
+
+#define MAX_BATCH   8
+#define QUEUE_SIZE  64
+#define DIRECT_SIZE (4*1024*1024)
+#define DIRECT_ALIGN 4096
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+static const struct {
+    enum PixelFormat fmt;
+    const char *tag;
+} y4m_tags[] = {
+    { PIX_FMT_YUV420P,   "C420jpeg"               },
+    { PIX_FMT_YUV422P,   "C422"                   },
+    { PIX_FMT_YUV444P,   "C444"                   },
+#ifdef PIX_FMT_YUV420P10
+    { PIX_FMT_YUV420P10, "C420p10 XYSCSS=420P10"  },
+#endif
+#ifdef PIX_FMT_YUV422P10
+    { PIX_FMT_YUV422P10, "C422p10 XYSCSS=422P10"  },
+#endif
+#ifdef PIX_FMT_YUV444P10
+    { PIX_FMT_YUV444P10, "C444p10 XYSCSS=444P10"  },
+#endif
+};
+
+static struct wr_entry {
+    struct frame *f;
+    struct timespec ts;
+} queue[QUEUE_SIZE];
+
+static unsigned queue_head;
+static unsigned queue_count;
+
+static pthread_mutex_t wr_lock;
+static pthread_cond_t wr_cond;
+static pthread_cond_t wr_space;
+static pthread_t wr_thread;
+static int wr_running;
+static int wr_stop;
+
+static const struct pixfmt *pixfmt;
+static unsigned row_size[3];
+static unsigned num_rows[3];
+
+static char *out_name;
+static int out_fd = -1;
+static int y4m;
+static int direct;
+
+static struct iovec *iov;
+
+static uint8_t *dbuf;
+static unsigned dbuf_len;
+
+static int
+write_all(const struct iovec *v, int n)
+{
+    struct iovec tmp[IOV_MAX];
+
+    while (n > 0) {
+        int cnt = MIN(n, IOV_MAX);
+        ssize_t len;
+        int i;
+
+        memcpy(tmp, v, cnt * sizeof(*v));
+
+        for (i = 0; i < cnt; ) {
+            len = writev(out_fd, tmp + i, cnt - i);
+            if (len < 0) {
+                if (errno == EINTR)
+                    continue;
+                perror("file: write");
+                return -1;
+            }
+
+            while (i < cnt && len >= tmp[i].iov_len)
+                len -= tmp[i++].iov_len;
+
+            if (len) {
+                tmp[i].iov_base = (uint8_t *)tmp[i].iov_base + len;
+                tmp[i].iov_len -= len;
+            }
+        }
+
+        v += cnt;
+        n -= cnt;
+    }
+
+    return 0;
+}
+
+static int
+direct_flush(unsigned len)
+{
+    struct iovec v = { dbuf, len };
+
+    if (write_all(&v, 1))
+        return -1;
+
+    memmove(dbuf, dbuf + len, dbuf_len - len);
+    dbuf_len -= len;
+
+    return 0;
+}
+
+static int
+direct_write(const struct iovec *v, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        const uint8_t *p = v[i].iov_base;
+        unsigned len = v[i].iov_len;
+
+        while (len) {
+            unsigned cnt = MIN(len, DIRECT_SIZE - dbuf_len);
+
+            memcpy(dbuf + dbuf_len, p, cnt);
+            dbuf_len += cnt;
+            p   += cnt;
+            len -= cnt;
+
+            if (dbuf_len == DIRECT_SIZE && direct_flush(DIRECT_SIZE))
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int
+add_frame(struct iovec *v, const struct wr_entry *e, char *hdr)
+{
+    struct frame *f = e->f;
+    int n = 0;
+    int i, j;
+
+    if (y4m) {
+        v[n].iov_base = hdr;
+        v[n].iov_len  = sprintf(hdr, "FRAME Xt=%ld.%09ld\n",
+                                (long)e->ts.tv_sec, e->ts.tv_nsec);
+        n++;
+    }
+
+    for (i = 0; i < 3; i++) {
+        uint8_t *p = f->vdata[i];
+
+        if (!row_size[i])
+            continue;
+
+        if (row_size[i] == f->linesize[i]) {
+            v[n].iov_base = p;
+            v[n].iov_len  = row_size[i] * num_rows[i];
+            n++;
+            continue;
+        }
+
+        for (j = 0; j < num_rows[i]; j++) {
+            v[n].iov_base = p;
+            v[n].iov_len  = row_size[i];
+            p += f->linesize[i];
+            n++;
+        }
+    }
+
+    return n;
+}
+
+/*
+ * Frames go back to the pool from this thread.  That relies on the pool
+ * lock in ofbp_put_frame().  They are returned only after wr_lock is
+ * dropped, so the two locks are never held together.
+ */
+static void *
+file_writer(void *p)
+{
+    struct wr_entry batch[MAX_BATCH];
+    char hdr[MAX_BATCH][64];
+    int err = 0;
+
+    pthread_mutex_lock(&wr_lock);
+
+    for (;;) {
+        int nb = 0;
+        int n = 0;
+        int i;
+
+        while (!queue_count && !wr_stop)
+            pthread_cond_wait(&wr_cond, &wr_lock);
+
+        if (!queue_count)
+            break;
+
+        while (queue_count && nb < MAX_BATCH) {
+            batch[nb++] = queue[queue_head];
+            queue_head = (queue_head + 1) % QUEUE_SIZE;
+            queue_count--;
+        }
+
+        pthread_cond_signal(&wr_space);
+
+        pthread_mutex_unlock(&wr_lock);
+
+        for (i = 0; i < nb; i++)
+            n += add_frame(iov + n, &batch[i], hdr[i]);
+
+        if (!err)
+            err = direct? direct_write(iov, n): write_all(iov, n);
+
+        for (i = 0; i < nb; i++)
+            ofbp_put_frame(batch[i].f);
+
+        pthread_mutex_lock(&wr_lock);
+    }
+
+    pthread_mutex_unlock(&wr_lock);
+
+    return NULL;
+}
+
+static void
+file_flush(void)
+{
+    if (!wr_running)
+        return;
+
+    pthread_mutex_lock(&wr_lock);
+    wr_stop = 1;
+    pthread_cond_signal(&wr_cond);
+    pthread_mutex_unlock(&wr_lock);
+
+    pthread_join(wr_thread, NULL);
+    wr_running = 0;
+}
+
+static int
+file_open(const char *arg, struct frame_format *dp, struct frame_format *ff)
+{
+    const char *fmt = NULL;
+    const char *p = arg;
+    int flags;
+    int len;
+
+    while (p && (len = strcspn(p, ",;")) > 0) {
+        int c = p[0];
+
+        if (p[1] != '=')
+            goto argerr;
+
+        switch (c) {
+        case 'o':
+            free(out_name);
+            out_name = strndup(p + 2, len - 2);
+            break;
+        case 'f':
+            fmt = p + 2;
+            break;
+        case 'd':
+            direct = strtol(p + 2, NULL, 0);
+            break;
+        default:
+            goto argerr;
+        }
+
+        p += len + !!p[len];
+    }
+
+    if (!out_name)
+        goto argerr;
+
+    if (fmt)
+        y4m = !strncmp(fmt, "y4m", 3);
+    else
+        y4m = strlen(out_name) > 4 &&
+            !strcmp(out_name + strlen(out_name) - 4, ".y4m");
+
+    if (!strcmp(out_name, "-")) {
+        out_fd = dup(1);
+        direct = 0;
+    } else {
+        flags = O_WRONLY | O_CREAT | O_TRUNC;
+        if (direct)
+            flags |= O_DIRECT;
+        out_fd = open(out_name, flags, 0666);
+        if (out_fd == -1 && direct) {
+            fprintf(stderr, "file: O_DIRECT not supported\n");
+            direct = 0;
+            out_fd = open(out_name, flags & ~O_DIRECT, 0666);
+        }
+    }
+
+    if (out_fd == -1) {
+        perror(out_name);
+        return -1;
+    }
+
+    dp->width  = ff->disp_w;
+    dp->height = ff->disp_h;
+    dp->pixfmt = ff->pixfmt;
+
+    return 0;
+
+argerr:
+    fprintf(stderr, "file: params: o=file|-,f=y4m|raw,d=direct\n");
+    return -1;
+}
+
+static int
+file_enable(struct frame_format *ff, unsigned flags,
+            const struct pixconv *pc, struct frame_format *df)
+{
+    const char *tag = NULL;
+    unsigned rows = 0;
+    int i;
+
+    pixfmt = ofbp_get_pixfmt(ff->pixfmt);
+    if (!pixfmt)
+        return -1;
+
+    for (i = 0; i < 3; i++) {
+        row_size[i] = 0;
+        num_rows[i] = 0;
+    }
+
+    for (i = 0; i < 3; i++) {
+        int n = pixfmt->plane[i];
+        row_size[n] = MAX(row_size[n],
+                          (ff->disp_w >> pixfmt->hsub[i]) * pixfmt->inc[i]);
+        num_rows[n] = MAX(num_rows[n], ff->disp_h >> pixfmt->vsub[i]);
+    }
+
+    for (i = 0; i < 3; i++)
+        rows += num_rows[i];
+
+    iov = malloc(MAX_BATCH * (rows + 1) * sizeof(*iov));
+    if (!iov)
+        return -1;
+
+    if (direct) {
+        void *buf;
+        if (posix_memalign(&buf, DIRECT_ALIGN, DIRECT_SIZE))
+            return -1;
+        dbuf = buf;
+        dbuf_len = 0;
+    }
+
+    if (y4m) {
+        char hdr[128];
+        struct iovec v = { hdr };
+
+        for (i = 0; i < ARRAY_SIZE(y4m_tags); i++)
+            if (y4m_tags[i].fmt == ff->pixfmt)
+                tag = y4m_tags[i].tag;
+
+        if (!tag) {
+            fprintf(stderr, "file: pixel format %d not supported by y4m\n",
+                    ff->pixfmt);
+            return -1;
+        }
+
+        v.iov_len = snprintf(hdr, sizeof(hdr),
+                             "YUV4MPEG2 W%u H%u F%u:%u Ip A0:0 %s\n",
+                             ff->disp_w, ff->disp_h,
+                             ff->rate_num? ff->rate_num: 25,
+                             ff->rate_den? ff->rate_den: 1, tag);
+
+        if (direct? direct_write(&v, 1): write_all(&v, 1))
+            return -1;
+    }
+
+    fprintf(stderr, "file: writing %s to %s%s\n", y4m? "y4m": "raw",
+            out_name, direct? " (O_DIRECT)": "");
+
+    pthread_mutex_init(&wr_lock, NULL);
+    pthread_cond_init(&wr_cond, NULL);
+    pthread_cond_init(&wr_space, NULL);
+    queue_head  = 0;
+    queue_count = 0;
+    wr_stop = 0;
+
+    if (pthread_create(&wr_thread, NULL, file_writer, NULL)) {
+        fprintf(stderr, "file: error starting writer thread\n");
+        return -1;
+    }
+    wr_running = 1;
+
+    return 0;
+}
+
+static void
+file_prepare(struct frame *f)
+{
+}
+
+static void
+file_show(struct frame *f)
+{
+    struct wr_entry *e;
+
+    pthread_mutex_lock(&wr_lock);
+    while (queue_count == QUEUE_SIZE)
+        pthread_cond_wait(&wr_space, &wr_lock);
+    e = &queue[(queue_head + queue_count++) % QUEUE_SIZE];
+    e->f = f;
+    clock_gettime(CLOCK_REALTIME, &e->ts);
+    pthread_cond_signal(&wr_cond);
+    pthread_mutex_unlock(&wr_lock);
+}
+
+static void
+file_close(void)
+{
+    file_flush();
+
+    if (direct && dbuf_len) {
+        unsigned len = dbuf_len & ~(DIRECT_ALIGN - 1);
+        if (len)
+            direct_flush(len);
+        fcntl(out_fd, F_SETFL, fcntl(out_fd, F_GETFL) & ~O_DIRECT);
+        direct_flush(dbuf_len);
+    }
+
+    free(dbuf);
+    dbuf = NULL;
+    free(iov);
+    iov = NULL;
+
+    close(out_fd);
+    out_fd = -1;
+
+    free(out_name);
+    out_name = NULL;
+}
+
+static const struct memman file_mem = {
+    .name         = "file",
+    .alloc_frames = ofbp_sysmem_alloc,
+    .free_frames  = ofbp_sysmem_free,
+};
+
+DISPLAY(file) = {
+    .name    = "file",
+    .flags   = OFBP_PRIV_MEM | OFBP_ANY_MEM,
+    .open    = file_open,
+    .enable  = file_enable,
+    .prepare = file_prepare,
+    .show    = file_show,
+    .flush   = file_flush,
+    .close   = file_close,
+    .memman  = &file_mem,
+};
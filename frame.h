@@ -34,6 +34,7 @@ struct frame_format {
     unsigned disp_w, disp_h;
     unsigned y_stride, uv_stride;
     enum PixelFormat pixfmt;
+    unsigned rate_num, rate_den;
 };
 
 struct frame {
@@ -49,11 +50,14 @@ struct frame {
     int next;
     int prev;
     int refs;
+    int fd;
+    unsigned offset;
 };
 
 #define MIN_FRAMES 2
 
 struct frame *ofbp_get_frame(void);
+void ofbp_ref_frame(struct frame *f);
 void ofbp_put_frame(struct frame *f);
 void ofbp_post_frame(struct frame *f);
 
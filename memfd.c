@@ -0,0 +1,395 @@
+/*
+    Copyright (C) 2011 Mans Rullgard
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+    HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/udmabuf.h>
+
+#include "frame.h"
+#include "memman.h"
+#include "pixfmt.h"
+#include "ofbp_memfd.h"
+#include "util.h"
+
+#define SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)
+
+static int mem_fd = -1;
+static uint8_t *frame_buf;
+static unsigned frame_buf_size;
+
+static const char *export_path;
+static int export_fd = -1;
+static int export_ro_fd = -1;
+static pthread_t export_thread;
+static struct ofbp_memfd_info export_info;
+static struct frame *export_frames;
+
+static int
+memfd_open(const char *param)
+{
+    export_path = param && *param? param: NULL;
+    return 0;
+}
+
+static int
+send_fd(int sock, const void *buf, size_t len, int fd)
+{
+    union {
+        struct cmsghdr cm;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } cbuf;
+    struct iovec iov = { (void *)buf, len };
+    struct msghdr msg = { 0 };
+    struct cmsghdr *cm;
+
+    msg.msg_iov    = &iov;
+    msg.msg_iovlen = 1;
+
+    if (fd != -1) {
+        msg.msg_control    = cbuf.buf;
+        msg.msg_controllen = sizeof(cbuf.buf);
+        cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type  = SCM_RIGHTS;
+        cm->cmsg_len   = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+    }
+
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == len? 0: -1;
+}
+
+static void *
+export_loop(void *p)
+{
+    int fd;
+    int i;
+
+    for (;;) {
+        fd = accept4(export_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+
+        if (!send_fd(fd, &export_info, sizeof(export_info), -1)) {
+            for (i = 0; i < export_info.num_frames; i++) {
+                struct ofbp_memfd_frame mf;
+                int ffd = export_frames[i].fd;
+
+                if (ffd == mem_fd && export_ro_fd != -1)
+                    ffd = export_ro_fd;
+
+                mf.index  = i;
+                mf.offset = export_frames[i].offset;
+
+                if (send_fd(fd, &mf, sizeof(mf), ffd))
+                    break;
+            }
+        }
+
+        close(fd);
+    }
+
+    return NULL;
+}
+
+/*
+ * Hand out the frame descriptors to anyone connecting to export_path,
+ * see ofbp_memfd.h.
+ */
+static int
+export_start(struct frame_format *ff, unsigned frame_size,
+             const int offs[3], const int stride[3],
+             struct frame *frames, unsigned num_frames)
+{
+    struct sockaddr_un sa = { .sun_family = AF_UNIX };
+    char proc_path[32];
+    int i;
+
+    if (strlen(export_path) >= sizeof(sa.sun_path)) {
+        fprintf(stderr, "memfd: socket path too long: %s\n", export_path);
+        return -1;
+    }
+    strcpy(sa.sun_path, export_path);
+
+    export_info.magic      = OFBP_MEMFD_MAGIC;
+    export_info.version    = OFBP_MEMFD_VERSION;
+    export_info.num_frames = num_frames;
+    export_info.width      = ff->width;
+    export_info.height     = ff->height;
+    export_info.pixfmt     = ff->pixfmt;
+    export_info.frame_size = frame_size;
+
+    for (i = 0; i < 3; i++) {
+        export_info.offsets[i] = offs[i];
+        export_info.strides[i] = stride[i];
+    }
+
+    export_frames = frames;
+
+    /* reopening through /proc gives a read-only file description */
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", mem_fd);
+    export_ro_fd = open(proc_path, O_RDONLY | O_CLOEXEC);
+    if (export_ro_fd == -1)
+        perror("memfd: read-only reopen");
+
+    export_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (export_fd == -1) {
+        perror("socket");
+        goto err;
+    }
+
+    unlink(export_path);
+
+    if (bind(export_fd, (struct sockaddr *)&sa, sizeof(sa)) ||
+        listen(export_fd, 4)) {
+        perror(export_path);
+        goto err;
+    }
+
+    if (pthread_create(&export_thread, NULL, export_loop, NULL)) {
+        fprintf(stderr, "memfd: error starting export thread\n");
+        unlink(export_path);
+        goto err;
+    }
+
+    fprintf(stderr, "memfd: exporting frames on %s\n", export_path);
+
+    return 0;
+
+err:
+    if (export_fd != -1)
+        close(export_fd);
+    export_fd = -1;
+    if (export_ro_fd != -1)
+        close(export_ro_fd);
+    export_ro_fd = -1;
+    return -1;
+}
+
+static void
+export_stop(void)
+{
+    if (export_fd == -1)
+        return;
+
+    /* wakes the thread from accept() */
+    shutdown(export_fd, SHUT_RDWR);
+    pthread_join(export_thread, NULL);
+
+    close(export_fd);
+    export_fd = -1;
+    unlink(export_path);
+
+    if (export_ro_fd != -1)
+        close(export_ro_fd);
+    export_ro_fd = -1;
+}
+
+static void
+memfd_free_frames(struct frame *frames, unsigned nf)
+{
+    int i;
+
+    export_stop();
+
+    for (i = 0; i < nf; i++)
+        if (frames[i].fd != mem_fd)
+            close(frames[i].fd);
+
+    munmap(frame_buf, frame_buf_size);
+    frame_buf = NULL;
+
+    close(mem_fd);
+    mem_fd = -1;
+
+    free(frames);
+}
+
+static int
+memfd_alloc(struct frame_format *ff, unsigned bufsize,
+            struct frame **fr, unsigned *nf, int dmabuf)
+{
+    const struct pixfmt *pf = ofbp_get_pixfmt(ff->pixfmt);
+    unsigned page_size = sysconf(_SC_PAGESIZE);
+    struct frame *frames = NULL;
+    unsigned num_frames;
+    unsigned frame_size;
+    int offs[3], stride[3];
+    int dev_fd = -1;
+    int i, j;
+
+    if (!pf) {
+        fprintf(stderr, "memfd: unsupported pixel format %d\n", ff->pixfmt);
+        return -1;
+    }
+
+    frame_size = ofbp_get_plane_layout(offs, stride, pf,
+                                       ff->width, ff->height);
+    frame_size = ALIGN(frame_size, page_size);
+    num_frames = MAX(bufsize / frame_size, MIN_FRAMES);
+    bufsize = num_frames * frame_size;
+
+    fprintf(stderr, "memfd: using %d frame buffers, frame_size=%d\n",
+            num_frames, frame_size);
+
+    if (dmabuf) {
+        dev_fd = open("/dev/udmabuf", O_RDWR);
+        if (dev_fd == -1) {
+            perror("/dev/udmabuf");
+            return -1;
+        }
+    }
+
+    mem_fd = memfd_create("omapfbplay", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (mem_fd == -1) {
+        perror("memfd_create");
+        goto err;
+    }
+
+    if (ftruncate(mem_fd, bufsize)) {
+        fprintf(stderr, "Error allocating frame buffers: %d bytes\n", bufsize);
+        goto err;
+    }
+
+    if (fcntl(mem_fd, F_ADD_SEALS, SEALS))
+        perror("memfd: F_ADD_SEALS");
+
+    frame_buf = mmap(NULL, bufsize, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     mem_fd, 0);
+    if (frame_buf == MAP_FAILED) {
+        perror("mmap");
+        frame_buf = NULL;
+        goto err;
+    }
+
+    frame_buf_size = bufsize;
+
+    frames = calloc(num_frames, sizeof(*frames));
+    if (!frames)
+        goto err;
+
+    for (i = 0; i < num_frames; i++) {
+        uint8_t *p = frame_buf + i * frame_size;
+
+        frames[i].ff = ff;
+        for (j = 0; j < 3; j++) {
+            frames[i].virt[j]     = p + offs[j];
+            frames[i].linesize[j] = stride[j];
+        }
+
+        if (dmabuf) {
+            struct udmabuf_create uc = {
+                .memfd  = mem_fd,
+                .flags  = UDMABUF_FLAGS_CLOEXEC,
+                .offset = i * frame_size,
+                .size   = frame_size,
+            };
+
+            frames[i].fd = ioctl(dev_fd, UDMABUF_CREATE, &uc);
+            frames[i].offset = 0;
+
+            if (frames[i].fd == -1) {
+                perror("UDMABUF_CREATE");
+                while (i--)
+                    close(frames[i].fd);
+                goto err;
+            }
+        } else {
+            frames[i].fd = mem_fd;
+            frames[i].offset = i * frame_size;
+        }
+    }
+
+    if (dev_fd != -1)
+        close(dev_fd);
+
+    ff->y_stride  = stride[0];
+    ff->uv_stride = stride[1];
+
+    if (export_path && export_start(ff, frame_size, offs, stride,
+                                    frames, num_frames)) {
+        memfd_free_frames(frames, num_frames);
+        return -1;
+    }
+
+    *fr = frames;
+    *nf = num_frames;
+
+    return 0;
+
+err:
+    free(frames);
+    if (frame_buf)
+        munmap(frame_buf, bufsize);
+    frame_buf = NULL;
+    if (mem_fd != -1)
+        close(mem_fd);
+    mem_fd = -1;
+    if (dev_fd != -1)
+        close(dev_fd);
+    return -1;
+}
+
+static int
+memfd_alloc_frames(struct frame_format *ff, unsigned bufsize,
+                   struct frame **fr, unsigned *nf)
+{
+    return memfd_alloc(ff, bufsize, fr, nf, 0);
+}
+
+static int
+udmabuf_alloc_frames(struct frame_format *ff, unsigned bufsize,
+                     struct frame **fr, unsigned *nf)
+{
+    return memfd_alloc(ff, bufsize, fr, nf, 1);
+}
+
+DRIVER(memman, memfd) = {
+    .name         = "memfd",
+    .flags        = OFBP_FD_MEM,
+    .open         = memfd_open,
+    .alloc_frames = memfd_alloc_frames,
+    .free_frames  = memfd_free_frames,
+};
+
+DRIVER(memman, udmabuf) = {
+    .name         = "udmabuf",
+    .flags        = OFBP_FD_MEM,
+    .open         = memfd_open,
+    .alloc_frames = udmabuf_alloc_frames,
+    .free_frames  = memfd_free_frames,
+};
@@ -30,6 +30,7 @@
 struct memman {
     const char *name;
     unsigned flags;
+    int  (*open)(const char *param);
     int  (*alloc_frames)(struct frame_format *ff, unsigned max_size,
                          struct frame **fr, unsigned *nf);
     void (*free_frames)(struct frame *frames, unsigned nf);
@@ -37,4 +38,8 @@ struct memman {
 
 extern const struct memman *ofbp_memman_start[];
 
+int  ofbp_sysmem_alloc(struct frame_format *ff, unsigned bufsize,
+                       struct frame **fr, unsigned *nf);
+void ofbp_sysmem_free(struct frame *frames, unsigned nf);
+
 #endif /* OFBP_MEM_H */
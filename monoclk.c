@@ -0,0 +1,337 @@
+/*
+    Copyright (C) 2011 Mans Rullgard
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+    HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/timerfd.h>
+
+#include "timer.h"
+
+#ifndef CLOCK_MONOTONIC_RAW
+#define CLOCK_MONOTONIC_RAW CLOCK_MONOTONIC
+#endif
+
+#if defined(__arm__) || defined(__aarch64__)
+#define cpu_relax() __asm__ volatile ("yield" ::: "memory")
+#elif defined(__i386__) || defined(__x86_64__)
+#define cpu_relax() __asm__ volatile ("pause" ::: "memory")
+#else
+#define cpu_relax() __asm__ volatile ("" ::: "memory")
+#endif
+
+#define MARGIN_MIN     20000
+#define MARGIN_MAX   2000000
+#define MARGIN_INIT   200000
+#define LATE_NS       100000
+
+static clockid_t read_clock;
+static int tfd = -1;
+static int tfd_armed;
+static struct timespec tfd_wake;
+
+static int spin;
+static int margin;
+static int lat_avg;
+static int lat_dev;
+static FILE *stats_file;
+
+static unsigned num_waits;
+static unsigned num_late;
+static unsigned ovs_max;
+static unsigned long long ovs_sum;
+static unsigned long long spin_sum;
+
+static int
+is_arg(const char *p, int len, const char *val)
+{
+    return len == strlen(val) && !strncmp(p, val, len);
+}
+
+static int
+monoclk_open(const char *arg)
+{
+    const char *p = arg;
+    int use_tfd = 0;
+    int len;
+
+    read_clock = CLOCK_MONOTONIC;
+
+    while (p && (len = strcspn(p, " ,;")) > 0) {
+        int c = p[0];
+
+        if (p[1] != '=')
+            goto argerr;
+
+        switch (c) {
+        case 'c':
+            if (is_arg(p + 2, len - 2, "raw"))
+                read_clock = CLOCK_MONOTONIC_RAW;
+            else if (!is_arg(p + 2, len - 2, "mono"))
+                goto argerr;
+            break;
+        case 'p':
+            spin = strtol(p + 2, NULL, 0);
+            break;
+        case 'w':
+            if (is_arg(p + 2, len - 2, "timerfd"))
+                use_tfd = 1;
+            else if (!is_arg(p + 2, len - 2, "sleep"))
+                goto argerr;
+            break;
+        case 'o': {
+            char *name = strndup(p + 2, len - 2);
+            if (!name || stats_file)
+                goto argerr;
+            stats_file = fopen(name, "w");
+            if (!stats_file) {
+                perror(name);
+                free(name);
+                return -1;
+            }
+            free(name);
+            break;
+        }
+        default:
+            goto argerr;
+        }
+
+        p += len + !!p[len];
+    }
+
+    if (use_tfd) {
+        tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (tfd == -1) {
+            perror("timerfd_create");
+            return -1;
+        }
+    }
+
+    tfd_armed = 0;
+    margin    = MARGIN_INIT;
+    lat_avg   = 0;
+    lat_dev   = 0;
+    num_waits = 0;
+    num_late  = 0;
+    ovs_max   = 0;
+    ovs_sum   = 0;
+    spin_sum  = 0;
+
+    return 0;
+
+argerr:
+    fprintf(stderr, "monotonic: params: c=mono|raw w=sleep|timerfd "
+            "p=precise o=statsfile\n");
+    return -1;
+}
+
+static int
+monoclk_start(struct timespec *ts)
+{
+    return clock_gettime(read_clock, ts);
+}
+
+static int
+monoclk_read(struct timespec *ts)
+{
+    return clock_gettime(read_clock, ts);
+}
+
+/*
+ * Deadlines are in the read clock.  For CLOCK_MONOTONIC_RAW, which
+ * cannot be slept on, translate to CLOCK_MONOTONIC using the current
+ * offset between the two.
+ */
+static void
+to_monotonic(struct timespec *ts)
+{
+    struct timespec raw, mono;
+
+    if (read_clock == CLOCK_MONOTONIC)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(read_clock, &raw);
+    ts_sub(&mono, &raw);
+    ts_add(ts, &mono);
+}
+
+static int
+sleep_until(const struct timespec *ts)
+{
+    struct timespec t = *ts;
+    int err;
+
+    to_monotonic(&t);
+
+    while ((err = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL))
+           == EINTR)
+        ;
+
+    return err? -1: 0;
+}
+
+/*
+ * Precise mode: sleep until margin ns before the deadline, then spin.
+ * The margin tracks the mean plus four mean deviations of the observed
+ * wakeup latency.
+ */
+static void
+update_margin(int lat)
+{
+    int dev = lat - lat_avg;
+
+    lat_avg += dev / 8;
+    lat_dev += ((dev < 0? -dev: dev) - lat_dev) / 8;
+
+    margin = lat_avg + 4 * lat_dev;
+    if (lat > margin)
+        margin = lat;
+    margin = MIN(MAX(margin, MARGIN_MIN), MARGIN_MAX);
+}
+
+/*
+ * With w=timerfd, arm the timerfd for the deadline so the caller can
+ * poll it alongside other descriptors, then call wait() to finish.  In
+ * precise mode it fires margin ns early and wait() spins the rest.
+ */
+static int
+monoclk_wait_fd(const struct timespec *ts)
+{
+    struct itimerspec its = { { 0, 0 }, *ts };
+
+    if (tfd == -1)
+        return -1;
+
+    if (spin) {
+        struct timespec m = { 0, margin };
+        ts_sub(&its.it_value, &m);
+    }
+
+    tfd_wake = its.it_value;
+    to_monotonic(&its.it_value);
+
+    if (timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL))
+        return -1;
+
+    tfd_armed = 1;
+
+    return tfd;
+}
+
+static int
+monoclk_wait(struct timespec *ts)
+{
+    struct timespec now, spin_start;
+    int armed = tfd_armed;
+    long long d;
+    unsigned ovs;
+
+    if (armed) {
+        uint64_t exp;
+
+        if (read(tfd, &exp, sizeof(exp)) < 0 && errno != EAGAIN)
+            return -1;
+        tfd_armed = 0;
+    }
+
+    if (!spin)
+        return sleep_until(ts);
+
+    clock_gettime(read_clock, &now);
+    d = ts_sdiff_ns(ts, &now);
+
+    if (armed)
+        update_margin(MAX(ts_sdiff_ns(&now, &tfd_wake), 0));
+
+    if (d <= 0)
+        return 0;
+
+    if (d > margin) {
+        struct timespec wake = *ts;
+        struct timespec m = { 0, margin };
+
+        ts_sub(&wake, &m);
+        if (sleep_until(&wake))
+            return -1;
+
+        clock_gettime(read_clock, &now);
+        update_margin(MAX(ts_sdiff_ns(&now, &wake), 0));
+    }
+
+    spin_start = now;
+    while (ts_sdiff_ns(ts, &now) > 0) {
+        cpu_relax();
+        clock_gettime(read_clock, &now);
+    }
+
+    ovs = ts_sdiff_ns(&now, ts);
+
+    num_waits++;
+    num_late += ovs > LATE_NS;
+    ovs_max   = MAX(ovs_max, ovs);
+    ovs_sum  += ovs;
+    spin_sum += ts_sdiff_ns(&now, &spin_start);
+
+    if (stats_file)
+        fprintf(stats_file, "%lu.%09lu %u %d\n",
+                (unsigned long)ts->tv_sec, (unsigned long)ts->tv_nsec,
+                ovs, margin);
+
+    return 0;
+}
+
+static int
+monoclk_close(void)
+{
+    if (num_waits)
+        fprintf(stderr, "monotonic: %u waits, overshoot avg %llu max %u ns, "
+                "%u over %u us, spin avg %llu us, margin %d us\n",
+                num_waits, ovs_sum / num_waits, ovs_max, num_late,
+                LATE_NS / 1000, spin_sum / num_waits / 1000, margin / 1000);
+
+    if (stats_file)
+        fclose(stats_file);
+    stats_file = NULL;
+
+    if (tfd != -1)
+        close(tfd);
+    tfd = -1;
+
+    return 0;
+}
+
+TIMER(monoclk) = {
+    .name    = "monotonic",
+    .open    = monoclk_open,
+    .start   = monoclk_start,
+    .read    = monoclk_read,
+    .wait    = monoclk_wait,
+    .wait_fd = monoclk_wait_fd,
+    .close   = monoclk_close,
+};
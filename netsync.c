@@ -22,9 +22,11 @@
     DEALINGS IN THE SOFTWARE.
  */
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
 #include <time.h>
 #include <poll.h>
 #include <errno.h>
@@ -33,11 +35,17 @@
 #include <pthread.h>
 #include <semaphore.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <netdb.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
 
 #include "timer.h"
 #include "util.h"
+#include "thread.h"
 
 /*
  * Protocol:
@@ -55,6 +63,17 @@
  *     ping()
  * else if (type == 4)
  *     pong()
+ * else if (type == 5)
+ *     beacon()
+ * else if (type == 6)
+ *     position()
+ * else if (type == 7)
+ *     delay()                          version 1
+ *
+ * hello() {
+ *     start_time       u32[2]          master reply, 0 if not started
+ *     max_version      u8              highest version the sender speaks
+ * }
  *
  * go() {
  *     start_time       u32[2]
@@ -66,49 +85,227 @@
  * }
  *
  * pong() {
- *     in_reply_to      u32[2]
+ *     in_reply_to      u32[2]          t1
+ *     received         u32[2]          t2, slave time the ping arrived, 0
+ *                                      if the slave does not report it
+ *     if (protocol_version >= 1)
+ *         sent         u32[2]          t3, slave time the pong was sent
+ * }
+ *
+ * beacon() {
+ *     master_time      u32[2]
+ * }
+ *
+ * position() {
+ *     frame_time       u32[2]          when the master showed frame
+ *     frame            u32
+ * }
+ *
+ * delay() {
+ *     in_reply_to      u32[2]          t3 from the pong
+ *     received         u32[2]          t4, master time the pong arrived
+ *     ping_sent        u32[2]          t1 as the kernel saw it leave, 0
+ *                                      if unknown
  * }
  *
+ * In multicast mode GO and BEACON go to the group address, with their
+ * own sequence numbers; everything else stays unicast.
+ *
+ * Version 0 slaves take the master time in a ping plus half the rtt
+ * the master last measured for them.  In version 1 the master answers
+ * each pong with a delay() so the slave has t1..t4 of one exchange and
+ * works out offset and path delay itself, without the slave's own
+ * turnaround in the delay.  Everything is sent as version 0 unless the
+ * peer has said it speaks version 1: the master learns this from the
+ * hello, and a slave answers each ping in the version it came in.
+ * Group messages are always version 0.
+ *
+ * Where the kernel can time transmitted packets, t1 and t3 are when the
+ * ping and pong actually left rather than the times written into them,
+ * which leaves the cost of the send path out of the delay.  When one of
+ * those stamps is missing, the exchange is not used.
+ *
  */
 
-#define MSG_SIZE 15
+#define PROTO_VERSION 1
+
+#define MSG_SIZE 27
 
 #define MSG_TYPE_HELLO 0
 #define MSG_TYPE_READY 1
 #define MSG_TYPE_GO    2
 #define MSG_TYPE_PING  3
 #define MSG_TYPE_PONG  4
-
-#define MSG_TYPE_LAST  MSG_TYPE_PONG
-
-#define PING_INTERVAL 1000
-#define PING_INTERVAL_MIN 100
+#define MSG_TYPE_BEACON 5
+#define MSG_TYPE_POS   6
+#define MSG_TYPE_DELAY 7
+
+#define MSG_TYPE_LAST  MSG_TYPE_DELAY
+
+#define PING_INTERVAL 1000      /* ms, slaves not reporting their time */
+#define PING_INTERVAL_MIN 100   /* ms, while a slave converges */
+#define PING_INTERVAL_MAX 2000  /* ms, once stable; below SLAVE_TIMEOUT */
+#define PING_SLACK 5            /* ms, pings due this soon go out together */
+#define PING_STABLE 200000      /* ns of drift change counted as stable */
+#define PING_UNSTABLE 1000000   /* ns of drift change restarting convergence */
+#define PING_STABLE_COUNT 4     /* stable pongs before backing off */
+#define BEACON_INTERVAL 200
+#define POS_INTERVAL 1000
+#define SLAVE_TIMEOUT 5         /* seconds of silence before a slave is dropped */
+#define START_TIMEOUT 10        /* seconds to wait for slaves to be ready */
+#define SYNC_TIMEOUT 30         /* seconds a slave waits to sync and for GO */
+#define STAMP_FALLBACK 8        /* exchanges missing a stamp before giving up */
+#define READY_RETRY 1000
+#define GO_REPEAT 3
+#define SEND_BATCH 64
+#define RTT_HIST 64             /* rtts kept per slave for the stats file */
+
+#define SYNC_WINDOW 32          /* ping samples kept by a slave */
+#define SYNC_MIN_SPAN 2000000000LL /* ns of samples needed to fit skew */
+#define RTT_SLACK 50000         /* extra rtt (ns) halving a sample's weight */
+#define MAX_SKEW 0.0005
+#define SLEW_TIME 1000000000LL  /* ns over which small corrections are spread */
+#define SLEW_MAX 0.0005         /* fastest slew, as a rate */
+#define STEP_LIMIT 20000000LL   /* ns of error stepped rather than slewed */
 
 struct netsync_msg {
+    uint8_t version;
     uint8_t type;
     uint8_t seqno;
+    uint8_t max_version;
     struct timespec time;
+    struct timespec rcvd;
+    struct timespec sent;
+    struct timespec tx;         /* not sent: when the message left */
+    uint32_t tx_key;            /* not sent: OPT_ID of a stamped send */
+    int tx_src;                 /* not sent: TS_* giving tx, 0 if guessed */
     unsigned rtt;
+    unsigned frame;
 };
 
 static struct slave {
-    struct sockaddr addr;
+    struct sockaddr_storage addr;
     socklen_t addrlen;
+    int hnext;
     unsigned rtt;
     unsigned seqno;
+    struct timespec last_seen;
+    int ready;
+    int version;
+
+    struct timespec next_ping;
+    struct timespec ping_sent;
+    struct timespec ping_tx;
+    uint32_t ping_key;
+    int ping_src;
+    unsigned ping_ival;
+    unsigned stable;
+
+    struct timespec off_time;   /* master view of the slave's clock */
+    long long offset;
+    double drift;
+    double drift_avg;
+    unsigned off_count;
+
+    unsigned rtts[RTT_HIST];
+    unsigned rtt_count;
+    unsigned pings;
+    unsigned lost;
+    uint8_t ping_seqno;
+    int answered;
 } *slaves;
 
 static unsigned num_slaves;
+static unsigned max_slaves;
 static unsigned seen_slaves;
 static unsigned ready_slaves;
+static unsigned start_timeout = START_TIMEOUT;
+static struct timespec ping_due;
+
+/*
+ * Slaves are hashed on address and port, chained through hnext, so
+ * the per-packet lookup does not depend on the number of slaves.
+ */
+static int *slave_hash;
+static unsigned hash_mask;
+
+/*
+ * A slave keeps a window of (local time, master - local offset, rtt)
+ * samples and fits master = local + clk_offset + clk_skew * (local -
+ * clk_ref) to them, weighting samples with low rtt more heavily.
+ */
+struct sync_sample {
+    struct timespec local;
+    long long offset;
+    unsigned rtt;
+};
+
+static struct sync_sample samples[SYNC_WINDOW];
 
 static struct timespec start_time;
-static struct timespec ping_time_local;
-static struct timespec ping_time_master;
-static unsigned rtt;
+static struct timespec join_epoch;
+
+static struct timespec pos_time;
+static unsigned pos_frame;
+static unsigned pos_seq;
+static struct timespec clk_ref;
+static long long clk_offset;
+static double clk_skew;
 static unsigned ping_count;
 
-static int sockfd;
+/*
+ * Once playing, a new fit does not take effect at once.  The difference
+ * between the old and new mapping at the time of the fit is kept in
+ * slew_err and run down to zero at slew_rate, so the clock seen by
+ * read and wait never jumps.  Together with MAX_SKEW this keeps it
+ * running at 1 +- 0.001 of the local clock.  Errors beyond STEP_LIMIT
+ * are stepped; last_read then holds the clock still rather than let it
+ * go backwards.
+ */
+static struct timespec slew_start;
+static long long slew_err;
+static double slew_rate;
+static struct timespec last_read;
+
+/*
+ * Receive timestamps come from the kernel so that wakeup latency does
+ * not end up in rtt and offset samples.  Hardware timestamps are raw
+ * NIC clock values and are only useful if the NIC has rx timestamping
+ * enabled (hwstamp_ctl, ptp4l) and its clock is kept in step with
+ * CLOCK_REALTIME (phc2sys).  Packets without one fall back to the
+ * software timestamp.
+ */
+#define TS_NONE 0
+#define TS_SOFT 1
+#define TS_HARD 2
+
+static int ts_mode = TS_SOFT;
+
+/*
+ * Transmit stamps are picked up from the error queue whenever poll
+ * reports it, never waited for.  With OPT_ID the kernel numbers the
+ * stamped packets sent on a socket from 0; tx_key counts along so each
+ * stamp finds its packet.  On the master, tx_slave maps recent keys to
+ * the slave pinged.
+ */
+#define TX_PENDING 4096
+
+static int tx_stamps;
+static uint32_t tx_key;
+static int tx_slave[TX_PENDING];
+
+static char *stats_file;
+static char *stats_tmp;
+
+static int sockfd = -1;
+static int mc_fd = -1;
+static struct sockaddr_storage mc_addr;
+static socklen_t mc_addrlen;
+static unsigned mc_seqno;
+static unsigned slave_rtt;
+static struct netsync_msg last_pong;
+static unsigned bad_stamps;
+static unsigned stamp_misses;
 
 static pthread_mutex_t ns_lock;
 static pthread_cond_t ns_cond;
@@ -139,11 +336,12 @@ put_be32(void *p, unsigned v)
 static int
 unpack_msg(struct netsync_msg *msg, const uint8_t buf[MSG_SIZE])
 {
-    if (buf[0]) {
+    if (buf[0] > PROTO_VERSION) {
         fprintf(stderr, "netsync: bad protocol version %d\n", buf[0]);
         return -1;
     }
 
+    msg->version = buf[0];
     msg->type = buf[1];
     if (msg->type > MSG_TYPE_LAST) {
         fprintf(stderr, "netsync: invalid message type %d\n", msg->type);
@@ -152,270 +350,1470 @@ unpack_msg(struct netsync_msg *msg, const uint8_t buf[MSG_SIZE])
 
     msg->seqno = buf[2];
 
-    if (msg->type >= MSG_TYPE_GO) {
+    if (msg->type >= MSG_TYPE_GO || msg->type == MSG_TYPE_HELLO) {
         msg->time.tv_sec  = get_be32(buf + 3);
         msg->time.tv_nsec = get_be32(buf + 7);
     }
 
+    if (msg->type == MSG_TYPE_HELLO)
+        msg->max_version = buf[11];
+
     if (msg->type == MSG_TYPE_PING)
         msg->rtt = get_be32(buf + 11);
 
-    return 0;
-}
+    if (msg->type == MSG_TYPE_POS)
+        msg->frame = get_be32(buf + 11);
+
+    if (msg->type == MSG_TYPE_PONG || msg->type == MSG_TYPE_DELAY) {
+        msg->rcvd.tv_sec  = get_be32(buf + 11);
+        msg->rcvd.tv_nsec = get_be32(buf + 15);
+    }
+
+    if (msg->type == MSG_TYPE_PONG || msg->type == MSG_TYPE_DELAY) {
+        msg->sent.tv_sec  = get_be32(buf + 19);
+        msg->sent.tv_nsec = get_be32(buf + 23);
+    }
+
+    return 0;
+}
+
+static unsigned
+pack_msg(const struct netsync_msg *msg, uint8_t buf[MSG_SIZE])
+{
+    unsigned len = 3;
+
+    buf[0] = msg->version;
+    buf[1] = msg->type;
+    buf[2] = msg->seqno;
+
+    if (msg->type >= MSG_TYPE_GO || msg->type == MSG_TYPE_HELLO) {
+        put_be32(buf + 3, msg->time.tv_sec);
+        put_be32(buf + 7, msg->time.tv_nsec);
+        len += 8;
+    }
+
+    if (msg->type == MSG_TYPE_HELLO) {
+        buf[11] = msg->max_version;
+        len += 1;
+    }
+
+    if (msg->type == MSG_TYPE_PING) {
+        put_be32(buf + 11, msg->rtt);
+        len += 4;
+    }
+
+    if (msg->type == MSG_TYPE_POS) {
+        put_be32(buf + 11, msg->frame);
+        len += 4;
+    }
+
+    if (msg->type == MSG_TYPE_PONG || msg->type == MSG_TYPE_DELAY) {
+        put_be32(buf + 11, msg->rcvd.tv_sec);
+        put_be32(buf + 15, msg->rcvd.tv_nsec);
+        len += 8;
+    }
+
+    if ((msg->type == MSG_TYPE_PONG && msg->version >= 1) ||
+        msg->type == MSG_TYPE_DELAY) {
+        put_be32(buf + 19, msg->sent.tv_sec);
+        put_be32(buf + 23, msg->sent.tv_nsec);
+        len += 8;
+    }
+
+    return len;
+}
+
+static int
+cmp_addr(const struct sockaddr *addr1, const struct sockaddr *addr2)
+{
+    if (addr1->sa_family != addr2->sa_family)
+        return 1;
+
+    if (addr1->sa_family == AF_INET) {
+        const struct sockaddr_in *in1 = (const struct sockaddr_in *)addr1;
+        const struct sockaddr_in *in2 = (const struct sockaddr_in *)addr2;
+
+        return in1->sin_addr.s_addr != in2->sin_addr.s_addr ||
+            in1->sin_port != in2->sin_port;
+    }
+
+    if (addr1->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *in1 = (const struct sockaddr_in6 *)addr1;
+        const struct sockaddr_in6 *in2 = (const struct sockaddr_in6 *)addr2;
+
+        return memcmp(&in1->sin6_addr, &in2->sin6_addr,
+                      sizeof(in1->sin6_addr)) ||
+            in1->sin6_port != in2->sin6_port ||
+            in1->sin6_scope_id != in2->sin6_scope_id;
+    }
+
+    return 1;
+}
+
+/* FNV-1a over address and port */
+static unsigned
+hash_addr(const struct sockaddr *addr)
+{
+    const uint8_t *p;
+    unsigned h = 2166136261u;
+    unsigned port;
+    int len;
+
+    if (addr->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+        p    = in6->sin6_addr.s6_addr;
+        len  = sizeof(in6->sin6_addr);
+        port = in6->sin6_port;
+    } else {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+        p    = (const uint8_t *)&in->sin_addr;
+        len  = sizeof(in->sin_addr);
+        port = in->sin_port;
+    }
+
+    while (len--)
+        h = (h ^ *p++) * 16777619;
+    h = (h ^ (port & 0xff)) * 16777619;
+    h = (h ^ (port >> 8))   * 16777619;
+
+    return h ^ h >> 16;
+}
+
+static void
+hash_insert(int i)
+{
+    int *head = &slave_hash[hash_addr((struct sockaddr *)&slaves[i].addr) &
+                            hash_mask];
+
+    slaves[i].hnext = *head;
+    *head = i;
+}
+
+static void
+hash_remove(int i)
+{
+    int *p = &slave_hash[hash_addr((struct sockaddr *)&slaves[i].addr) &
+                         hash_mask];
+
+    while (*p != i)
+        p = &slaves[*p].hnext;
+    *p = slaves[i].hnext;
+}
+
+/* size the table to at least twice max_slaves and rehash */
+static int
+hash_resize(void)
+{
+    unsigned size = 16;
+    int *h;
+    int i;
+
+    while (size < 2 * max_slaves)
+        size *= 2;
+
+    h = malloc(size * sizeof(*h));
+    if (!h)
+        return -1;
+
+    for (i = 0; i < size; i++)
+        h[i] = -1;
+
+    free(slave_hash);
+    slave_hash = h;
+    hash_mask = size - 1;
+
+    for (i = 0; i < seen_slaves; i++)
+        hash_insert(i);
+
+    return 0;
+}
+
+static const char *
+addr_str(const struct slave *s, char *buf, size_t size)
+{
+    if (getnameinfo((const struct sockaddr *)&s->addr, s->addrlen,
+                    buf, size, NULL, 0, NI_NUMERICHOST))
+        snprintf(buf, size, "?");
+    return buf;
+}
+
+/*
+ * The slave table grows as slaves appear and may be reallocated, so
+ * it is only modified with ns_lock held, and other threads must hold
+ * ns_lock while using it.
+ */
+static struct slave *
+find_slave(struct sockaddr *addr, socklen_t addrlen)
+{
+    char name[INET6_ADDRSTRLEN];
+    struct slave *s;
+    int i;
+
+    for (i = slave_hash[hash_addr(addr) & hash_mask]; i >= 0;
+         i = slaves[i].hnext)
+        if (!cmp_addr(addr, (struct sockaddr *)&slaves[i].addr))
+            return &slaves[i];
+
+    if (seen_slaves == max_slaves) {
+        unsigned n = max_slaves * 2;
+
+        s = realloc(slaves, n * sizeof(*slaves));
+        if (!s)
+            return NULL;
+
+        slaves = s;
+        max_slaves = n;
+
+        if (hash_resize())
+            return NULL;
+    }
+
+    s = &slaves[seen_slaves];
+    memset(s, 0, sizeof(*s));
+    memcpy(&s->addr, addr, addrlen);
+    s->addrlen = addrlen;
+    s->ping_ival = PING_INTERVAL_MIN;
+    hash_insert(seen_slaves++);
+
+    fprintf(stderr, "netsync: new slave %s\n",
+            addr_str(s, name, sizeof(name)));
+
+    return s;
+}
+
+static void
+expire_slaves(const struct timespec *now)
+{
+    char name[INET6_ADDRSTRLEN];
+    int i;
+
+    pthread_mutex_lock(&ns_lock);
+
+    for (i = seen_slaves; i-- > 0;) {
+        struct slave *s = &slaves[i];
+
+        if (ts_sdiff_ns(now, &s->last_seen) < SLAVE_TIMEOUT * 1000000000LL)
+            continue;
+
+        fprintf(stderr, "netsync: slave %s timed out\n",
+                addr_str(s, name, sizeof(name)));
+
+        ready_slaves -= s->ready;
+        hash_remove(i);
+
+        if (i != --seen_slaves) {
+            hash_remove(seen_slaves);
+            *s = slaves[seen_slaves];
+            hash_insert(i);
+            if (tx_slave[s->ping_key % TX_PENDING] == seen_slaves)
+                tx_slave[s->ping_key % TX_PENDING] = i;
+        }
+    }
+
+    pthread_mutex_unlock(&ns_lock);
+}
+
+/*
+ * Some drivers accept SO_TIMESTAMPING but never deliver transmit
+ * stamps.  After STAMP_FALLBACK exchanges in a row without one, stop
+ * asking and use the times written into the packets instead.
+ */
+static void
+stamp_missed(int missed)
+{
+    if (!missed) {
+        stamp_misses = 0;
+        return;
+    }
+
+    if (tx_stamps && ++stamp_misses >= STAMP_FALLBACK) {
+        fprintf(stderr, "netsync: no transmit stamps for %u exchanges, "
+                "using send times\n", stamp_misses);
+        tx_stamps = 0;
+    }
+}
+
+/* send times are taken as late as possible */
+static void
+stamp_msg(struct netsync_msg *msg, uint8_t *buf)
+{
+    if (msg->type == MSG_TYPE_PING || msg->type == MSG_TYPE_BEACON) {
+        clock_gettime(CLOCK_REALTIME, &msg->time);
+        put_be32(buf + 3, msg->time.tv_sec);
+        put_be32(buf + 7, msg->time.tv_nsec);
+    } else if (msg->type == MSG_TYPE_PONG && msg->version >= 1) {
+        clock_gettime(CLOCK_REALTIME, &msg->sent);
+        put_be32(buf + 19, msg->sent.tv_sec);
+        put_be32(buf + 23, msg->sent.tv_nsec);
+    }
+}
+
+static int
+send_msg(struct netsync_msg *msg, const struct sockaddr *addr,
+         socklen_t addrlen)
+{
+    uint8_t buf[MSG_SIZE];
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(uint32_t))];
+    } ctl;
+    struct iovec iov = { buf, pack_msg(msg, buf) };
+    struct msghdr mh = { 0 };
+    uint32_t flags = SOF_TIMESTAMPING_TX_SOFTWARE;
+    int want_tx;
+    int n;
+
+    want_tx = tx_stamps && (msg->type == MSG_TYPE_PING ||
+                            (msg->type == MSG_TYPE_PONG &&
+                             msg->version >= 1));
+
+    mh.msg_name    = (void *)addr;
+    mh.msg_namelen = addrlen;
+    mh.msg_iov     = &iov;
+    mh.msg_iovlen  = 1;
+
+    if (want_tx) {
+        struct cmsghdr *cm;
+
+        if (ts_mode == TS_HARD)
+            flags |= SOF_TIMESTAMPING_TX_HARDWARE;
+
+        mh.msg_control    = &ctl;
+        mh.msg_controllen = sizeof(ctl);
+        cm = CMSG_FIRSTHDR(&mh);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type  = SO_TIMESTAMPING;
+        cm->cmsg_len   = CMSG_LEN(sizeof(flags));
+        memcpy(CMSG_DATA(cm), &flags, sizeof(flags));
+    }
+
+    stamp_msg(msg, buf);
+    n = sendmsg(sockfd, &mh, 0);
+
+    /* until its stamp turns up, the time written into the packet */
+    msg->tx = msg->type == MSG_TYPE_PONG? msg->sent: msg->time;
+    msg->tx_src = TS_NONE;
+    msg->tx_key = tx_key;
+    if (n >= 0 && want_tx)
+        tx_key++;
+
+    return n;
+}
+
+static int
+send_slave_msg(struct netsync_msg *msg, struct slave *s)
+{
+    msg->seqno = s->seqno++;
+    return send_msg(msg, (struct sockaddr *)&s->addr, s->addrlen);
+}
+
+static void
+send_batch(struct mmsghdr *mm, int n)
+{
+    struct pollfd pfd = { sockfd, POLLOUT };
+
+    while (n > 0) {
+        int r = sendmmsg(sockfd, mm, n, 0);
+
+        if (r < 0) {
+            if (errno == EAGAIN) {
+                poll(&pfd, 1, 10);
+                continue;
+            }
+            if (errno != EINTR) {
+                mm++;
+                n--;
+            }
+            continue;
+        }
+
+        mm += r;
+        n  -= r;
+    }
+}
+
+/*
+ * Send msg to every slave speaking at least min_version, over the
+ * group if there is one and every slave can take it.
+ */
+static void
+bcast_msg(struct netsync_msg *msg, int min_version)
+{
+    uint8_t pkt[MSG_SIZE];
+    uint8_t buf[SEND_BATCH][MSG_SIZE];
+    struct iovec iov[SEND_BATCH];
+    struct mmsghdr mm[SEND_BATCH];
+    unsigned len;
+    int i, j;
+
+    len = pack_msg(msg, pkt);
+
+    if (mc_addrlen && !min_version) {
+        pkt[2] = mc_seqno++;
+        stamp_msg(msg, pkt);
+        sendto(sockfd, pkt, len, 0, (struct sockaddr *)&mc_addr, mc_addrlen);
+        return;
+    }
+
+    memset(mm, 0, sizeof(mm));
+
+    for (i = 0; i < seen_slaves; ) {
+        for (j = 0; j < SEND_BATCH && i < seen_slaves; i++) {
+            struct slave *s = &slaves[i];
+
+            if (s->version < min_version)
+                continue;
+
+            memcpy(buf[j], pkt, len);
+            buf[j][2] = s->seqno++;
+
+            iov[j].iov_base = buf[j];
+            iov[j].iov_len  = len;
+
+            mm[j].msg_hdr.msg_name    = &s->addr;
+            mm[j].msg_hdr.msg_namelen = s->addrlen;
+            mm[j].msg_hdr.msg_iov     = &iov[j];
+            mm[j].msg_hdr.msg_iovlen  = 1;
+            j++;
+        }
+
+        send_batch(mm, j);
+    }
+}
+
+static int
+netsync_recv(int fd, struct netsync_msg *msg, struct timespec *rtime,
+             struct sockaddr_storage *addr, socklen_t *addrlen)
+{
+    uint8_t buf[MSG_SIZE] = { 0 };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(struct timespec)) +
+                 CMSG_SPACE(sizeof(struct scm_timestamping))];
+    } ctl;
+    struct iovec iov = { buf, sizeof(buf) };
+    struct msghdr mh = { 0 };
+    struct cmsghdr *cm;
+    int n;
+
+    mh.msg_name       = addr;
+    mh.msg_namelen    = addr? sizeof(*addr): 0;
+    mh.msg_iov        = &iov;
+    mh.msg_iovlen     = 1;
+    mh.msg_control    = &ctl;
+    mh.msg_controllen = sizeof(ctl);
+
+    n = recvmsg(fd, &mh, 0);
+    if (n < 0 && errno != EAGAIN)
+        return -1;
+    if (n <= 0)
+        return 0;
+
+    if (addr)
+        *addrlen = mh.msg_namelen;
+
+    rtime->tv_sec = 0;
+
+    for (cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)) {
+        if (cm->cmsg_level != SOL_SOCKET)
+            continue;
+
+        if (cm->cmsg_type == SCM_TIMESTAMPNS) {
+            memcpy(rtime, CMSG_DATA(cm), sizeof(*rtime));
+        } else if (cm->cmsg_type == SCM_TIMESTAMPING) {
+            struct scm_timestamping st;
+
+            memcpy(&st, CMSG_DATA(cm), sizeof(st));
+            if (st.ts[2].tv_sec)
+                *rtime = st.ts[2];
+            else if (st.ts[0].tv_sec)
+                *rtime = st.ts[0];
+        }
+    }
+
+    if (!rtime->tv_sec)
+        clock_gettime(CLOCK_REALTIME, rtime);
+
+    if (unpack_msg(msg, buf))
+        return 0;
+
+    return 1;
+}
+
+/* a transmit stamp for the packet sent as key; ns_lock held on the master */
+static void
+tx_done(uint32_t key, const struct timespec *ts, int src)
+{
+    if (num_slaves) {
+        int i = tx_slave[key % TX_PENDING];
+        struct slave *s;
+
+        if (i >= seen_slaves)
+            return;
+
+        s = &slaves[i];
+        if (!s->pings || s->ping_key != key || s->ping_src > src)
+            return;
+
+        s->ping_tx  = *ts;
+        s->ping_src = src;
+    } else if (last_pong.type == MSG_TYPE_PONG && last_pong.tx_key == key &&
+               last_pong.tx_src <= src) {
+        last_pong.tx     = *ts;
+        last_pong.tx_src = src;
+    }
+}
+
+/*
+ * Collect the transmit stamps queued on fd.  Anything else making
+ * poll() report an error, such as an ICMP port unreachable, is cleared
+ * so that the socket does not stay readable forever.  On the master,
+ * call with ns_lock held.
+ */
+static void
+read_errqueue(int fd)
+{
+    char ctl[256];
+    struct msghdr mh;
+    struct cmsghdr *cm;
+    socklen_t len;
+    int err;
+
+    for (;;) {
+        struct scm_timestamping st;
+        struct sock_extended_err ee;
+        int have_ts = 0;
+        int have_key = 0;
+
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_control    = ctl;
+        mh.msg_controllen = sizeof(ctl);
+
+        if (recvmsg(fd, &mh, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            break;
+
+        for (cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)) {
+            if (cm->cmsg_level == SOL_SOCKET &&
+                cm->cmsg_type == SCM_TIMESTAMPING) {
+                memcpy(&st, CMSG_DATA(cm), sizeof(st));
+                have_ts = 1;
+            } else if ((cm->cmsg_level == SOL_IP &&
+                        cm->cmsg_type == IP_RECVERR) ||
+                       (cm->cmsg_level == SOL_IPV6 &&
+                        cm->cmsg_type == IPV6_RECVERR)) {
+                memcpy(&ee, CMSG_DATA(cm), sizeof(ee));
+                have_key = ee.ee_errno == ENOMSG &&
+                    ee.ee_origin == SO_EE_ORIGIN_TIMESTAMPING;
+            }
+        }
+
+        if (!have_ts || !have_key)
+            continue;
+
+        if (st.ts[2].tv_sec)
+            tx_done(ee.ee_data, &st.ts[2], TS_HARD);
+        else if (st.ts[0].tv_sec)
+            tx_done(ee.ee_data, &st.ts[0], TS_SOFT);
+    }
+
+    len = sizeof(err);
+    getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+}
+
+static void
+ping_slave(struct slave *s)
+{
+    struct netsync_msg msg;
+
+    msg.version = s->version;
+    msg.type = MSG_TYPE_PING;
+    msg.rtt = s->rtt;
+
+    /* a ping still unanswered when the next goes out counts as lost */
+    if (s->pings && !s->answered)
+        s->lost++;
+
+    send_slave_msg(&msg, s);
+    s->ping_sent   = msg.time;
+    s->ping_tx     = msg.tx;
+    s->ping_key    = msg.tx_key;
+    s->ping_src    = msg.tx_src;
+    tx_slave[msg.tx_key % TX_PENDING] = s - slaves;
+    s->ping_seqno  = msg.seqno;
+    s->answered    = 0;
+    s->pings++;
+}
+
+static void
+sched_ping(struct slave *s, const struct timespec *from)
+{
+    s->next_ping = *from;
+    ts_add_ns(&s->next_ping, s->ping_ival * 1000000);
+
+    if (ts_sdiff_ns(&s->next_ping, &ping_due) < 0)
+        ping_due = s->next_ping;
+}
+
+/*
+ * A slave is pinged often while its clock is being fitted and less
+ * as the fit settles.  The pong says when the slave received each
+ * ping, giving the master its own rough view of the slave's offset.
+ * Steady skew is harmless, so stability is judged by how much the
+ * drift between two pongs differs from the drift before.
+ */
+static void
+adapt_ping(struct slave *s, const struct netsync_msg *msg)
+{
+    long long off = ts_sdiff_ns(&msg->rcvd, &msg->time) - s->rtt / 2;
+    long long dt = ts_sdiff_ns(&msg->time, &s->off_time);
+    long long err = 0;
+    double drift = 0;
+
+    if (s->off_count && dt > 0) {
+        drift = (double)(off - s->offset) / dt;
+        err = llabs(llrint((drift - s->drift) * dt));
+    }
+
+    s->off_time = msg->time;
+    s->offset   = off;
+    s->drift    = drift;
+
+    if (++s->off_count < 3)
+        return;
+
+    s->drift_avg += (drift - s->drift_avg) / 8;
+
+    if (err < PING_STABLE) {
+        if (++s->stable >= PING_STABLE_COUNT) {
+            s->stable = 0;
+            s->ping_ival = MIN(s->ping_ival * 2, PING_INTERVAL_MAX);
+        }
+        return;
+    }
+
+    s->stable = 0;
+    if (err > PING_UNSTABLE)
+        s->ping_ival = PING_INTERVAL_MIN;
+    else
+        s->ping_ival = MAX(s->ping_ival / 2, PING_INTERVAL_MIN);
+
+    sched_ping(s, &s->ping_sent);
+}
+
+/* send every ping that is due, and find when the next one is */
+static void
+ping_slaves(const struct timespec *now)
+{
+    struct timespec due = *now;
+    int i;
+
+    ts_add_ns(&due, PING_SLACK * 1000000);
+
+    ping_due = *now;
+    ts_add_ns(&ping_due, PING_INTERVAL_MAX * 1000000);
+
+    for (i = 0; i < seen_slaves; i++) {
+        struct slave *s = &slaves[i];
+
+        if (ts_sdiff_ns(&s->next_ping, &due) <= 0) {
+            ping_slave(s);
+            sched_ping(s, now);
+        } else if (ts_sdiff_ns(&s->next_ping, &ping_due) < 0) {
+            ping_due = s->next_ping;
+        }
+    }
+}
+
+static void
+master_recv(void)
+{
+    struct netsync_msg msg;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    struct timespec rtime;
+    int cur;
+
+    while (netsync_recv(sockfd, &msg, &rtime, &addr, &addrlen) > 0) {
+        struct slave *s;
+
+        /* our own group traffic loops back to slaves on this host */
+        if (msg.type != MSG_TYPE_HELLO && msg.type != MSG_TYPE_READY &&
+            msg.type != MSG_TYPE_PONG)
+            continue;
+
+        pthread_mutex_lock(&ns_lock);
+
+        s = find_slave((struct sockaddr *)&addr, addrlen);
+        if (!s) {
+            pthread_mutex_unlock(&ns_lock);
+            continue;
+        }
+
+        s->last_seen = rtime;
+
+        switch (msg.type) {
+        case MSG_TYPE_HELLO:
+            s->version = MIN(msg.max_version, PROTO_VERSION);
+            msg.max_version = PROTO_VERSION;
+            /* tells a late joiner where playback is */
+            msg.time = start_time;
+            send_slave_msg(&msg, s);
+            break;
+
+        case MSG_TYPE_READY:
+            if (!s->ready) {
+                s->ready = 1;
+                ready_slaves++;
+                pthread_cond_broadcast(&ns_cond);
+            }
+            if (start_time.tv_sec) {
+                msg.type = MSG_TYPE_GO;
+                msg.time = start_time;
+                send_slave_msg(&msg, s);
+            }
+            break;
+
+        case MSG_TYPE_PONG:
+            /* a late pong to an earlier ping still gives an rtt */
+            cur = !ts_sdiff_ns(&msg.time, &s->ping_sent);
+            if (msg.seqno == s->ping_seqno)
+                s->answered = 1;
+
+            /* the ping's stamp may not have been collected yet */
+            if (cur && tx_stamps && s->ping_src == TS_NONE)
+                read_errqueue(sockfd);
+            if (cur && tx_stamps)
+                stamp_missed(s->ping_src == TS_NONE);
+
+            s->rtt = ts_diff_ns(&rtime, &msg.time);
+            if (msg.version >= 1 && cur) {
+                s->rtt = ts_diff_ns(&rtime, &s->ping_tx);
+                s->rtt -= MIN(ts_diff_ns(&msg.sent, &msg.rcvd), s->rtt);
+            }
+
+            s->rtts[s->rtt_count++ % RTT_HIST] = s->rtt;
+
+            if (!msg.rcvd.tv_sec)
+                s->ping_ival = PING_INTERVAL;
+            else if (cur)
+                adapt_ping(s, &msg);
+
+            if (msg.version >= 1) {
+                msg.type = MSG_TYPE_DELAY;
+                msg.time = msg.sent;
+                msg.rcvd = rtime;
+                msg.sent = s->ping_tx;
+                /* t1 unknown: stale pong, or the ping's stamp is missing */
+                if (!cur || (tx_stamps && s->ping_src == TS_NONE))
+                    msg.sent.tv_sec = msg.sent.tv_nsec = 0;
+                send_slave_msg(&msg, s);
+            }
+            break;
+        }
+
+        pthread_mutex_unlock(&ns_lock);
+    }
+}
+
+static int
+cmp_uint(const void *a, const void *b)
+{
+    unsigned x = *(const unsigned *)a;
+    unsigned y = *(const unsigned *)b;
+
+    return x < y? -1: x > y;
+}
+
+/*
+ * One line per slave, replaced atomically so readers never see a
+ * partial file.  Offset and drift are the master's rough view of the
+ * slave clock relative to its own; rtt percentiles are over the last
+ * RTT_HIST pongs.
+ */
+static void
+write_stats(const struct timespec *now)
+{
+    char name[INET6_ADDRSTRLEN];
+    unsigned rtts[RTT_HIST];
+    FILE *f;
+    int i;
+
+    f = fopen(stats_tmp, "w");
+    if (!f)
+        return;
+
+    fprintf(f, "# slave version ready rtt_p50_us rtt_p90_us rtt_p99_us "
+            "offset_us drift_ppm ping_ms pings lost loss_%% last_seen_ms\n");
+
+    pthread_mutex_lock(&ns_lock);
+
+    for (i = 0; i < seen_slaves; i++) {
+        struct slave *s = &slaves[i];
+        unsigned n = MIN(s->rtt_count, RTT_HIST);
+
+        fprintf(f, "%s %d %d ", addr_str(s, name, sizeof(name)),
+                s->version, s->ready);
+
+        if (n) {
+            memcpy(rtts, s->rtts, n * sizeof(*rtts));
+            qsort(rtts, n, sizeof(*rtts), cmp_uint);
+            fprintf(f, "%u %u %u ", rtts[(n - 1) * 50 / 100] / 1000,
+                    rtts[(n - 1) * 90 / 100] / 1000,
+                    rtts[(n - 1) * 99 / 100] / 1000);
+        } else {
+            fprintf(f, "- - - ");
+        }
+
+        if (s->off_count)
+            fprintf(f, "%lld %.3f ", s->offset / 1000, s->drift_avg * 1e6);
+        else
+            fprintf(f, "- - ");
+
+        fprintf(f, "%u %u %u %.1f %lld\n", s->ping_ival, s->pings, s->lost,
+                s->pings? 100.0 * s->lost / s->pings: 0.0,
+                ts_sdiff_ns(now, &s->last_seen) / 1000000);
+    }
+
+    pthread_mutex_unlock(&ns_lock);
+
+    if (fclose(f) || rename(stats_tmp, stats_file))
+        perror("netsync: stats file");
+}
+
+static void
+set_timer(int tfd, const struct timespec *t)
+{
+    struct itimerspec its = { { 0 } };
+
+    its.it_value = *t;
+    timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static struct timespec *
+ts_min(struct timespec *a, struct timespec *b)
+{
+    return ts_sdiff_ns(a, b) <= 0? a: b;
+}
+
+/*
+ * Incoming packets and the timers are separate event sources, so a
+ * busy socket cannot hold back pings, beacons or position updates.
+ */
+static void *
+netsync_master(void *p)
+{
+    struct epoll_event ev[2];
+    struct timespec now, next_beacon, next_expire, next_pos;
+    struct timespec *next;
+    int epfd, tfd;
+    int i, n;
+
+    fprintf(stderr, "netsync: master starting\n");
+
+    ofbp_thread_setup(OFBP_THREAD_NETSYNC);
+
+    epfd = epoll_create1(0);
+    tfd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK);
+    if (epfd == -1 || tfd == -1) {
+        perror("netsync: master event loop");
+        goto out;
+    }
+
+    ev[0].events = EPOLLIN;
+    ev[0].data.fd = sockfd;
+    ev[1].events = EPOLLIN;
+    ev[1].data.fd = tfd;
+
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &ev[0]) ||
+        epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev[1])) {
+        perror("netsync: epoll_ctl");
+        goto out;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    next_beacon = next_expire = next_pos = ping_due = now;
+
+    while (!ns_stop) {
+        clock_gettime(CLOCK_REALTIME, &now);
+
+        if (ts_sdiff_ns(&now, &next_expire) >= 0) {
+            next_expire = now;
+            next_expire.tv_sec++;
+            expire_slaves(&now);
+            if (stats_file)
+                write_stats(&now);
+        }
+
+        if (mc_addrlen && ts_sdiff_ns(&now, &next_beacon) >= 0) {
+            struct netsync_msg msg = { .type = MSG_TYPE_BEACON };
+
+            next_beacon = now;
+            ts_add_ns(&next_beacon, BEACON_INTERVAL * 1000000);
+
+            pthread_mutex_lock(&ns_lock);
+            bcast_msg(&msg, 0);
+            pthread_mutex_unlock(&ns_lock);
+        }
+
+        if (ts_sdiff_ns(&now, &next_pos) >= 0) {
+            struct netsync_msg msg = { .type = MSG_TYPE_POS };
+
+            next_pos = now;
+            ts_add_ns(&next_pos, POS_INTERVAL * 1000000);
+
+            pthread_mutex_lock(&ns_lock);
+            if (pos_time.tv_sec) {
+                msg.time  = pos_time;
+                msg.frame = pos_frame;
+                /* version 0 slaves do not know POS */
+                bcast_msg(&msg, 1);
+            }
+            pthread_mutex_unlock(&ns_lock);
+        }
+
+        pthread_mutex_lock(&ns_lock);
+        if (ts_sdiff_ns(&now, &ping_due) >= 0)
+            ping_slaves(&now);
+
+        next = ts_min(&next_expire, &next_pos);
+        if (mc_addrlen)
+            next = ts_min(next, &next_beacon);
+        next = ts_min(next, &ping_due);
+        set_timer(tfd, next);
+        pthread_mutex_unlock(&ns_lock);
+
+        n = epoll_wait(epfd, ev, 2, 1000);
+        if (n < 0 && errno != EINTR) {
+            perror("netsync: epoll_wait");
+            break;
+        }
+
+        for (i = 0; i < n; i++) {
+            if (ev[i].data.fd == sockfd) {
+                /* reported whether asked for or not */
+                if (ev[i].events & EPOLLERR) {
+                    pthread_mutex_lock(&ns_lock);
+                    read_errqueue(sockfd);
+                    pthread_mutex_unlock(&ns_lock);
+                }
+                if (ev[i].events & EPOLLIN)
+                    master_recv();
+            } else {
+                uint64_t exp;
+                if (read(tfd, &exp, sizeof(exp)) < 0 && errno != EAGAIN)
+                    perror("netsync: timerfd");
+            }
+        }
+    }
+
+out:
+    if (tfd != -1)
+        close(tfd);
+    if (epfd != -1)
+        close(epfd);
+
+    return NULL;
+}
+
+/* remaining correction at local time l, ns_lock held */
+static long long
+slew_rem(const struct timespec *l)
+{
+    long long d = MAX(ts_sdiff_ns(l, &slew_start), 0);
+    long long done = llrint(slew_rate * d);
+
+    if (done >= llabs(slew_err))
+        return 0;
+
+    return slew_err > 0? slew_err - done: slew_err + done;
+}
+
+/* master - local at local time l, ns_lock held */
+static long long
+clk_map(const struct timespec *l)
+{
+    return clk_offset + llrint(clk_skew * ts_sdiff_ns(l, &clk_ref)) +
+        slew_rem(l);
+}
+
+/* local time at which the master clock reads t, ns_lock held */
+static void
+clk_unmap(struct timespec *t)
+{
+    struct timespec l = *t;
+    long long rem;
+    long long d;
+
+    ts_add_sns(&l, -clk_offset);
+    d = ts_sdiff_ns(&l, &clk_ref);
+    ts_add_sns(&l, -llrint(clk_skew * d / (1 + clk_skew)));
+
+    /* the slew is slow enough for one correction step to do */
+    rem = slew_rem(&l);
+    ts_add_sns(&l, -llrint(rem / (1 + clk_skew)));
+
+    *t = l;
+}
+
+static void
+set_clock(const struct timespec *ref, long long offset, double skew)
+{
+    struct timespec now;
+    long long err;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    err = clk_map(&now);
+
+    clk_ref    = *ref;
+    clk_offset = offset;
+    clk_skew   = skew;
+    slew_err   = 0;
+
+    /* before playback starts, corrections are free */
+    if (!ping_count || !start_time.tv_sec)
+        return;
+
+    err -= clk_map(&now);
+
+    if (llabs(err) >= STEP_LIMIT) {
+        fprintf(stderr, "netsync: stepping clock by %lld us\n", -err / 1000);
+        return;
+    }
+
+    slew_start = now;
+    slew_err   = err;
+    slew_rate  = MIN((double)llabs(err) / SLEW_TIME, SLEW_MAX);
+}
+
+static void
+fit_clock(void)
+{
+    const struct sync_sample *ref;
+    unsigned n = MIN(ping_count + 1, SYNC_WINDOW);
+    unsigned rtt_min = ~0U;
+    double sw = 0, sx = 0, sy = 0, sxx = 0, sxy = 0;
+    double xm, ym, skew = 0;
+    long long span = 0;
+    int i;
+
+    ref = &samples[ping_count % SYNC_WINDOW];
+
+    for (i = 0; i < n; i++)
+        rtt_min = MIN(rtt_min, samples[i].rtt);
+
+    for (i = 0; i < n; i++) {
+        const struct sync_sample *s = &samples[i];
+        double w = 1.0 / (1.0 + (double)(s->rtt - rtt_min) / RTT_SLACK);
+        long long dx = ts_sdiff_ns(&s->local, &ref->local);
+        double x = dx;
+        double y = s->offset - ref->offset;
+
+        w *= w;
+        sw  += w;
+        sx  += w * x;
+        sy  += w * y;
+        sxx += w * x * x;
+        sxy += w * x * y;
+        span = MAX(span, -dx);
+    }
+
+    xm = sx / sw;
+    ym = sy / sw;
+
+    if (span >= SYNC_MIN_SPAN) {
+        skew = (sxy - sw * xm * ym) / (sxx - sw * xm * xm);
+        skew = MIN(MAX(skew, -MAX_SKEW), MAX_SKEW);
+    }
+
+    pthread_mutex_lock(&ns_lock);
+    set_clock(&ref->local, ref->offset + llrint(ym - skew * xm), skew);
+    ping_count++;
+    pthread_cond_broadcast(&ns_cond);
+    pthread_mutex_unlock(&ns_lock);
+}
+
+static void
+add_sample(const struct timespec *rtime, const struct timespec *mtime,
+           unsigned rtt)
+{
+    struct sync_sample *s = &samples[ping_count % SYNC_WINDOW];
+
+    s->local  = *rtime;
+    s->offset = ts_sdiff_ns(mtime, rtime) + rtt / 2;
+    s->rtt    = rtt;
+
+    fit_clock();
+}
+
+static void
+slave_msg(struct netsync_msg *msg, const struct timespec *rtime)
+{
+    long long rtt;
+
+    switch (msg->type) {
+    case MSG_TYPE_GO:
+        pthread_mutex_lock(&ns_lock);
+        start_time = msg->time;
+        pthread_cond_broadcast(&ns_cond);
+        pthread_mutex_unlock(&ns_lock);
+        break;
+
+    case MSG_TYPE_PING:
+        msg->type = MSG_TYPE_PONG;
+        msg->rcvd = *rtime;
+        send_msg(msg, NULL, 0);
+
+        if (msg->version >= 1) {
+            /* wait for the delay() to complete the exchange */
+            last_pong = *msg;
+            break;
+        }
 
-static unsigned
-pack_msg(const struct netsync_msg *msg, uint8_t buf[MSG_SIZE])
-{
-    unsigned len = 3;
+        /* the first ping to a slave carries no rtt yet */
+        slave_rtt = msg->rtt;
+        if (slave_rtt)
+            add_sample(rtime, &msg->time, slave_rtt);
+        break;
 
-    buf[0] = 0;
-    buf[1] = msg->type;
-    buf[2] = msg->seqno;
+    case MSG_TYPE_DELAY:
+        if (ts_sdiff_ns(&msg->time, &last_pong.sent))
+            break;
 
-    if (msg->type >= MSG_TYPE_GO) {
-        put_be32(buf + 3, msg->time.tv_sec);
-        put_be32(buf + 7, msg->time.tv_nsec);
-        len += 8;
-    }
+        if (tx_stamps && last_pong.tx_src == TS_NONE)
+            read_errqueue(sockfd);
+        if (tx_stamps)
+            stamp_missed(last_pong.tx_src == TS_NONE);
+
+        /*
+         * An exchange missing a stamp for t1 or t3 would mix packet
+         * times with send path latency, or with another packet's
+         * stamp, so it is dropped rather than fitted.
+         */
+        if (!msg->sent.tv_sec || (tx_stamps && last_pong.tx_src == TS_NONE)) {
+            bad_stamps++;
+            break;
+        }
 
-    if (msg->type == MSG_TYPE_PING) {
-        put_be32(buf + 11, msg->rtt);
-        len += 4;
+        /*
+         * offset = ((t1 - t2) + (t4 - t3)) / 2, which add_sample()
+         * gets from t1 - t2 plus half the rtt (t4 - t1) - (t3 - t2)
+         */
+        last_pong.time = msg->sent;
+
+        rtt = ts_sdiff_ns(&msg->rcvd, &last_pong.time) -
+            ts_sdiff_ns(&last_pong.tx, &last_pong.rcvd);
+        slave_rtt = MAX(rtt, 1);
+        add_sample(&last_pong.rcvd, &last_pong.time, slave_rtt);
+        break;
+
+    case MSG_TYPE_BEACON:
+        /* one-way: assume half the last rtt measured by a ping */
+        if (slave_rtt)
+            add_sample(rtime, &msg->time, slave_rtt);
+        break;
+
+    case MSG_TYPE_POS:
+        pthread_mutex_lock(&ns_lock);
+        pos_time  = msg->time;
+        pos_frame = msg->frame;
+        pos_seq++;
+        pthread_mutex_unlock(&ns_lock);
+        break;
     }
-
-    return len;
 }
 
-static int
-cmp_addr(const struct sockaddr *addr1, const struct sockaddr *addr2)
+static void *
+netsync_slave(void *p)
 {
-    const struct sockaddr_in *in1, *in2;
+    struct pollfd pfd[2] = { { sockfd, POLLIN }, { mc_fd, POLLIN } };
+    int nfds = mc_fd != -1? 2: 1;
 
-    if (addr1->sa_family != addr2->sa_family)
-        return 1;
+    fprintf(stderr, "netsync: slave starting\n");
 
-    if (addr1->sa_family != AF_INET)
-        return 1;
+    ofbp_thread_setup(OFBP_THREAD_NETSYNC);
 
-    in1 = (const struct sockaddr_in *)addr1;
-    in2 = (const struct sockaddr_in *)addr2;
+    while (poll(pfd, nfds, 1000) >= 0 && !ns_stop) {
+        struct netsync_msg msg;
+        struct timespec rtime;
+        int i;
+
+        for (i = 0; i < nfds; i++) {
+            if (pfd[i].revents & POLLERR)
+                read_errqueue(pfd[i].fd);
+            if (pfd[i].revents & POLLIN &&
+                netsync_recv(pfd[i].fd, &msg, &rtime, NULL, 0) > 0)
+                slave_msg(&msg, &rtime);
+        }
+    }
 
-    return in1->sin_addr.s_addr != in2->sin_addr.s_addr ||
-        in1->sin_port != in2->sin_port;
+    return NULL;
 }
 
-static struct slave *
-find_slave(struct sockaddr *addr, socklen_t addrlen)
+static int
+netsync_hello(void)
 {
-    int i;
+    struct netsync_msg omsg = { .type = MSG_TYPE_HELLO,
+                                .max_version = PROTO_VERSION };
+    struct netsync_msg imsg;
+    struct pollfd pfd = { sockfd, POLLIN };
+    struct timespec ts;
+    int ack = 10;
 
-    for (i = 0; i < seen_slaves; i++)
-        if (!cmp_addr(addr, &slaves[i].addr))
+    while (--ack) {
+        send_msg(&omsg, NULL, 0);
+        if (!poll(&pfd, 1, 1000))
+            continue;
+        if (netsync_recv(sockfd, &imsg, &ts, NULL, 0) > 0 &&
+            imsg.type == MSG_TYPE_HELLO) {
+            join_epoch = imsg.time;
             break;
-
-    if (i == seen_slaves && i < num_slaves) {
-        fprintf(stderr, "netsync: new slave found\n");
-        slaves[i].addr = *addr;
-        slaves[i].addrlen = addrlen;
-        seen_slaves++;
+        }
+        sleep(1);
     }
 
-    return i < seen_slaves? &slaves[i]: NULL;
+    return ack;
 }
 
 static int
-send_msg(const struct netsync_msg *msg, const struct sockaddr *addr,
-         socklen_t addrlen)
+is_arg(const char *p, int len, const char *val)
 {
-    uint8_t buf[MSG_SIZE];
-    unsigned len = pack_msg(msg, buf);
-    return sendto(sockfd, buf, len, 0, addr, addrlen);
+    return len == strlen(val) && !strncmp(p, val, len);
 }
 
-static int
-send_slave_msg(struct netsync_msg *msg, struct slave *s)
+/* split host[:port] or [host]:port, the latter for IPv6 literals */
+static char *
+parse_host(const char *p, int len, unsigned *port)
 {
-    msg->seqno = s->seqno++;
-    return send_msg(msg, &s->addr, s->addrlen);
+    const char *e = p + len;
+    const char *c;
+    char *host;
+
+    if (*p == '[') {
+        c = memchr(p, ']', len);
+        if (!c)
+            return NULL;
+        host = strndup(p + 1, c - p - 1);
+        c++;
+    } else {
+        c = memchr(p, ':', len);
+        if (!c || memchr(c + 1, ':', e - c - 1))
+            c = e;
+        host = strndup(p, c - p);
+    }
+
+    if (host && c < e && *c == ':')
+        *port = strtol(c + 1, NULL, 0);
+
+    return host;
 }
 
-static void
-bcast_msg(const struct netsync_msg *msg)
+static int
+set_group(const char *group, unsigned short port)
 {
-    uint8_t buf[MSG_SIZE];
-    unsigned len;
-    int i;
+    struct addrinfo hints = { 0 };
+    struct addrinfo *ai;
+    char serv[sizeof("65535")];
+    int mc;
 
-    len = pack_msg(msg, buf);
+    hints.ai_flags    = AI_NUMERICHOST | AI_NUMERICSERV;
+    hints.ai_socktype = SOCK_DGRAM;
 
-    for (i = 0; i < seen_slaves; i++) {
-        buf[2] = slaves[i].seqno++;
-        sendto(sockfd, buf, len, 0, &slaves[i].addr, slaves[i].addrlen);
-    }
+    snprintf(serv, sizeof(serv), "%hu", port);
+
+    if (getaddrinfo(group, serv, &hints, &ai))
+        goto notmc;
+
+    memcpy(&mc_addr, ai->ai_addr, ai->ai_addrlen);
+    mc_addrlen = ai->ai_addrlen;
+    freeaddrinfo(ai);
+
+    if (mc_addr.ss_family == AF_INET6)
+        mc = IN6_IS_ADDR_MULTICAST(
+            &((struct sockaddr_in6 *)&mc_addr)->sin6_addr);
+    else
+        mc = IN_MULTICAST(
+            ntohl(((struct sockaddr_in *)&mc_addr)->sin_addr.s_addr));
+
+    if (mc)
+        return 0;
+
+    mc_addrlen = 0;
+notmc:
+    fprintf(stderr, "netsync: %s is not a multicast group\n", group);
+    return -1;
 }
 
+/* returns 0 if transmit stamps can be had as well */
 static int
-netsync_recv(int fd, struct netsync_msg *msg, struct timespec *rtime,
-             struct sockaddr *addr, socklen_t *addrlen)
+enable_stamps(int fd)
 {
-    uint8_t buf[MSG_SIZE];
-    int n;
+    int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE |
+        SOF_TIMESTAMPING_OPT_TSONLY | SOF_TIMESTAMPING_OPT_ID;
+    int on = 1;
 
-    n = recvfrom(sockfd, buf, sizeof(buf), 0, addr, addrlen);
-    if (n < 0 && errno != EAGAIN)
+    if (ts_mode == TS_NONE)
         return -1;
-    if (n <= 0)
-        return 0;
 
-    clock_gettime(CLOCK_REALTIME, rtime);
+    /* tx stamps are requested per packet, see send_msg() */
+    if (ts_mode == TS_HARD)
+        flags |= SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
 
-    if (unpack_msg(msg, buf))
+    if (!setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)))
         return 0;
 
-    return 1;
+    perror("netsync: SO_TIMESTAMPING");
+
+    if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)))
+        perror("netsync: SO_TIMESTAMPNS");
+
+    return -1;
 }
 
-static void
-master_recv(void)
+static int
+join_group(void)
 {
-    struct netsync_msg msg;
-    struct sockaddr addr;
-    socklen_t addrlen = sizeof(addr);
-    struct timespec rtime;
-
-    while (netsync_recv(sockfd, &msg, &rtime, &addr, &addrlen) > 0) {
-        struct slave *s = find_slave(&addr, addrlen);
-        if (!s)
-            continue;
+    int on = 1;
+    int err;
 
-        switch (msg.type) {
-        case MSG_TYPE_HELLO:
-            send_slave_msg(&msg, s);
-            break;
+    mc_fd = socket(mc_addr.ss_family, SOCK_DGRAM, 0);
+    if (mc_fd == -1)
+        return -1;
 
-        case MSG_TYPE_READY:
-            pthread_mutex_lock(&ns_lock);
-            ready_slaves++;
-            pthread_cond_broadcast(&ns_cond);
-            pthread_mutex_unlock(&ns_lock);
-            break;
+    setsockopt(mc_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
 
-        case MSG_TYPE_PONG:
-            s->rtt = ts_diff_ns(&rtime, &msg.time);
-            break;
-        }
+    if (bind(mc_fd, (struct sockaddr *)&mc_addr, mc_addrlen)) {
+        perror("netsync: bind multicast");
+        return -1;
     }
-}
-
-static void
-ping_slave(struct slave *s)
-{
-    struct netsync_msg msg;
 
-    msg.type = MSG_TYPE_PING;
-    clock_gettime(CLOCK_REALTIME, &msg.time);
-    msg.rtt = s->rtt;
+    if (mc_addr.ss_family == AF_INET6) {
+        struct ipv6_mreq mreq;
 
-    send_slave_msg(&msg, s);
-}
+        mreq.ipv6mr_multiaddr = ((struct sockaddr_in6 *)&mc_addr)->sin6_addr;
+        mreq.ipv6mr_interface = 0;
 
-static void *
-netsync_master(void *p)
-{
-    struct pollfd pfd = { sockfd, POLLIN };
-    int ping_interval = MIN(PING_INTERVAL / num_slaves, PING_INTERVAL_MIN);
-    int next_ping = 0;
-    int n;
+        err = setsockopt(mc_fd, IPPROTO_IPV6, IPV6_JOIN_GROUP,
+                         &mreq, sizeof(mreq));
+    } else {
+        struct ip_mreq mreq;
 
-    fprintf(stderr, "netsync: master starting\n");
+        mreq.imr_multiaddr = ((struct sockaddr_in *)&mc_addr)->sin_addr;
+        mreq.imr_interface.s_addr = htonl(INADDR_ANY);
 
-    while (!ns_stop && (n = poll(&pfd, 1, ping_interval)) >= 0) {
-        if (n) {
-            master_recv();
-            continue;
-        }
+        err = setsockopt(mc_fd, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+                         &mreq, sizeof(mreq));
+    }
 
-        if (next_ping < seen_slaves) {
-            ping_slave(&slaves[next_ping]);
-            if (++next_ping == num_slaves)
-                next_ping = 0;
-        }
+    if (err) {
+        perror("netsync: join multicast group");
+        return -1;
     }
 
-    return NULL;
+    enable_stamps(mc_fd);
+    fcntl(mc_fd, F_SETFL, (int)O_NONBLOCK);
+
+    return 0;
 }
 
-static void *
-netsync_slave(void *p)
+/*
+ * Without a group, the master listens on a dual-stack IPv6 socket so
+ * IPv4 slaves can join as mapped addresses.  With a group, the socket
+ * must match the group's family.
+ */
+static int
+master_socket(unsigned port)
 {
-    struct pollfd pfd = { sockfd, POLLIN };
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int family = mc_addrlen? mc_addr.ss_family: AF_INET6;
+    int on = 1, off = 0;
 
-    fprintf(stderr, "netsync: slave starting\n");
+    sockfd = socket(family, SOCK_DGRAM, 0);
+    if (sockfd == -1 && !mc_addrlen) {
+        family = AF_INET;
+        sockfd = socket(family, SOCK_DGRAM, 0);
+    }
+    if (sockfd == -1) {
+        perror("netsync: socket");
+        return -1;
+    }
 
-    while (poll(&pfd, 1, 1000) >= 0 && !ns_stop) {
-        struct netsync_msg msg;
-        struct timespec rtime;
+    /* slaves on this host may bind the group to the same port */
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
 
-        if (netsync_recv(sockfd, &msg, &rtime, NULL, 0) <= 0)
-            continue;
+    memset(&addr, 0, sizeof(addr));
 
+    if (family == AF_INET6) {
+        struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&addr;
 
-        switch (msg.type) {
-        case MSG_TYPE_GO:
-            pthread_mutex_lock(&ns_lock);
-            start_time = msg.time;
-            pthread_cond_broadcast(&ns_cond);
-            pthread_mutex_unlock(&ns_lock);
-            break;
+        setsockopt(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
 
-        case MSG_TYPE_PING:
-            ping_time_local  = rtime;
-            ping_time_master = msg.time;
-            rtt = msg.rtt;
+        in6->sin6_family = AF_INET6;
+        in6->sin6_addr   = in6addr_any;
+        in6->sin6_port   = htons(port);
+        addrlen = sizeof(*in6);
+    } else {
+        struct sockaddr_in *in = (struct sockaddr_in *)&addr;
 
-            msg.type = MSG_TYPE_PONG;
-            send_msg(&msg, NULL, 0);
+        in->sin_family      = AF_INET;
+        in->sin_addr.s_addr = htonl(INADDR_ANY);
+        in->sin_port        = htons(port);
+        addrlen = sizeof(*in);
+    }
 
-            pthread_mutex_lock(&ns_lock);
-            ping_count++;
-            pthread_cond_broadcast(&ns_cond);
-            pthread_mutex_unlock(&ns_lock);
-            break;
-        }
+    if (bind(sockfd, (struct sockaddr *)&addr, addrlen)) {
+        perror("netsync: bind");
+        return -1;
     }
 
-    return NULL;
+    return 0;
 }
 
 static int
-netsync_hello(void)
+slave_socket(const char *host, unsigned short port)
 {
-    struct netsync_msg omsg = { .type = MSG_TYPE_HELLO };
-    struct netsync_msg imsg;
-    struct pollfd pfd = { sockfd, POLLIN };
-    struct timespec ts;
-    int ack = 10;
+    struct addrinfo hints = { 0 };
+    struct addrinfo *res, *ai;
+    char serv[sizeof("65535")];
+    int err;
 
-    while (--ack) {
-        send_msg(&omsg, NULL, 0);
-        if (!poll(&pfd, 1, 1000))
+    hints.ai_socktype = SOCK_DGRAM;
+    snprintf(serv, sizeof(serv), "%hu", port);
+
+    err = getaddrinfo(host, serv, &hints, &res);
+    if (err) {
+        fprintf(stderr, "netsync: %s: %s\n", host, gai_strerror(err));
+        return -1;
+    }
+
+    for (ai = res; ai; ai = ai->ai_next) {
+        sockfd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (sockfd == -1)
             continue;
-        if (netsync_recv(sockfd, &imsg, &ts, NULL, 0) > 0 &&
-            imsg.type == MSG_TYPE_HELLO)
+        if (!connect(sockfd, ai->ai_addr, ai->ai_addrlen))
             break;
-        sleep(1);
+        close(sockfd);
+        sockfd = -1;
     }
 
-    return ack;
+    freeaddrinfo(res);
+
+    if (sockfd == -1) {
+        fprintf(stderr, "netsync: cannot reach master %s\n", host);
+        return -1;
+    }
+
+    return 0;
 }
 
 static int
 netsync_open(const char *arg)
 {
     char *host = NULL;
+    char *group = NULL;
+    unsigned group_port = 0;
     unsigned port = 0;
     const char *p = arg;
-    char *q;
     int len;
 
     if (!arg)
@@ -434,20 +1832,38 @@ netsync_open(const char *arg)
         case 's':
             num_slaves = strtol(p, NULL, 0);
             break;
+        case 't':
+            start_timeout = strtol(p, NULL, 0);
+            break;
         case 'm':
-            host = malloc(len + 1);
+            host = parse_host(p, len, &port);
             if (!host)
-                goto err;
-            q = memccpy(host, p, ':', len);
-            host[len] = 0;
-            if (q) {
-                q[-1] = 0;
-                port = strtol(p + (q - host), NULL, 0);
-            }
+                goto argerr;
             break;
         case 'p':
             port = strtol(p, NULL, 0);
             break;
+        case 'o':
+            free(stats_file);
+            stats_file = strndup(p, len);
+            if (!stats_file)
+                goto err;
+            break;
+        case 'k':
+            if (is_arg(p, len, "none"))
+                ts_mode = TS_NONE;
+            else if (is_arg(p, len, "sw"))
+                ts_mode = TS_SOFT;
+            else if (is_arg(p, len, "hw"))
+                ts_mode = TS_HARD;
+            else
+                goto argerr;
+            break;
+        case 'g':
+            group = parse_host(p, len, &group_port);
+            if (!group)
+                goto argerr;
+            break;
         default:
             goto argerr;
         }
@@ -455,39 +1871,44 @@ netsync_open(const char *arg)
         p += len + !!p[len];
     }
 
-    if (!port || (!num_slaves && !host))
+    if (!port || port > 65535 || group_port > 65535 ||
+        (!num_slaves && !host))
         goto argerr;
 
-    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sockfd == -1)
+    sockfd = -1;
+    mc_addrlen = 0;
+    mc_fd = -1;
+    tx_key = 0;
+
+    if (group && set_group(group, group_port? group_port: port))
         goto err;
 
-    fcntl(sockfd, F_SETFL, (int)O_NONBLOCK);
+    if (stats_file) {
+        stats_tmp = malloc(strlen(stats_file) + 5);
+        if (!stats_tmp)
+            goto err;
+        sprintf(stats_tmp, "%s.tmp", stats_file);
+    }
 
     if (num_slaves) {
-        struct sockaddr_in addr;
-
-        slaves = calloc(num_slaves, sizeof(*slaves));
-        if (!slaves)
+        max_slaves = MAX(num_slaves, 16);
+        slaves = calloc(max_slaves, sizeof(*slaves));
+        if (!slaves || hash_resize())
             goto err;
 
-        addr.sin_family = AF_INET;
-        addr.sin_addr.s_addr = htonl(INADDR_ANY);
-        addr.sin_port = htons(port);
+        if (master_socket(port))
+            goto err;
 
-        bind(sockfd, (struct sockaddr *)&addr, sizeof(addr));
+        tx_stamps = !enable_stamps(sockfd);
+        fcntl(sockfd, F_SETFL, (int)O_NONBLOCK);
     } else {
-        struct hostent *hent = gethostbyname(host);
-        struct sockaddr_in addr;
-
-        if (!hent)
+        if (slave_socket(host, port))
             goto err;
 
-        addr.sin_family = AF_INET;
-        addr.sin_addr.s_addr = *(uint32_t*)hent->h_addr_list[0];
-        addr.sin_port = htons(port);
+        tx_stamps = !enable_stamps(sockfd);
+        fcntl(sockfd, F_SETFL, (int)O_NONBLOCK);
 
-        if (connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)))
+        if (mc_addrlen && join_group())
             goto err;
 
         if (!netsync_hello()) {
@@ -506,62 +1927,198 @@ netsync_open(const char *arg)
                    slaves? netsync_master: netsync_slave, NULL);
 
     free(host);
+    free(group);
     return 0;
 
 argerr:
-    fprintf(stderr, "netsync: params: s=slaves p=port | m=host:port\n");
+    fprintf(stderr, "netsync: params: s=slaves p=port [t=start_timeout] "
+            "[o=statsfile] | m=host:port [g=group[:port]]\n"
+            "netsync: both: [k=none|sw|hw] receive timestamps\n"
+            "netsync: IPv6 addresses with a port are written [addr]:port\n");
 err:
+    if (sockfd != -1)
+        close(sockfd);
+    sockfd = -1;
+    if (mc_fd != -1)
+        close(mc_fd);
+    mc_fd = -1;
+    free(slave_hash);
+    slave_hash = NULL;
     free(slaves);
+    slaves = NULL;
+    free(stats_file);
+    stats_file = NULL;
+    free(stats_tmp);
+    stats_tmp = NULL;
     free(host);
+    free(group);
     return -1;
 }
 
+/* wait with ns_lock held for the clock fit to settle */
+static int
+wait_synced(const struct timespec *deadline)
+{
+    while (ping_count < 10)
+        if (pthread_cond_timedwait(&ns_cond, &ns_lock, deadline))
+            return -1;
+
+    return 0;
+}
+
 static int
 netsync_start(struct timespec *ts)
 {
-    struct netsync_msg msg;
+    struct netsync_msg msg = { 0 };
+    int i;
+
+    struct timespec deadline;
 
     if (slaves) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += start_timeout;
+
         pthread_mutex_lock(&ns_lock);
         while (ready_slaves < num_slaves)
-            pthread_cond_wait(&ns_cond, &ns_lock);
-        pthread_mutex_unlock(&ns_lock);
+            if (pthread_cond_timedwait(&ns_cond, &ns_lock, &deadline))
+                break;
+
+        if (ready_slaves < num_slaves)
+            fprintf(stderr, "netsync: starting with %u of %u slaves ready\n",
+                    ready_slaves, num_slaves);
 
         msg.type = MSG_TYPE_GO;
         clock_gettime(CLOCK_REALTIME, &msg.time);
         msg.time.tv_sec++;
+        start_time = msg.time;
+
+        /* multicast is unacknowledged, so repeat the GO */
+        for (i = 0; i < (mc_addrlen? GO_REPEAT: 1); i++)
+            bcast_msg(&msg, 0);
+        pthread_mutex_unlock(&ns_lock);
 
-        bcast_msg(&msg);
         *ts = msg.time;
     } else {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += SYNC_TIMEOUT;
+
         pthread_mutex_lock(&ns_lock);
-        while (ping_count < 10)
-            pthread_cond_wait(&ns_cond, &ns_lock);
-        pthread_mutex_unlock(&ns_lock);
+        if (wait_synced(&deadline))
+            fprintf(stderr, "netsync: clock not settled after %d s\n",
+                    SYNC_TIMEOUT);
 
-        msg.type = MSG_TYPE_READY;
-        send_msg(&msg, NULL, 0);
+        /* resend READY until the GO arrives, in case it was lost */
+        while (!start_time.tv_sec) {
+            struct timespec retry, now;
 
-        pthread_mutex_lock(&ns_lock);
-        while (!start_time.tv_sec)
-            pthread_cond_wait(&ns_cond, &ns_lock);
+            clock_gettime(CLOCK_REALTIME, &now);
+            if (ts_sdiff_ns(&now, &deadline) >= 0)
+                break;
+
+            msg.type = MSG_TYPE_READY;
+            send_msg(&msg, NULL, 0);
+
+            retry = now;
+            ts_add_ns(&retry, READY_RETRY * 1000000);
+            if (ts_sdiff_ns(&retry, &deadline) > 0)
+                retry = deadline;
+            while (!start_time.tv_sec &&
+                   !pthread_cond_timedwait(&ns_cond, &ns_lock, &retry))
+                ;
+        }
+
+        if (start_time.tv_sec) {
+            *ts = start_time;
+        } else {
+            fprintf(stderr, "netsync: no GO from master, starting now\n");
+            clock_gettime(CLOCK_REALTIME, ts);
+            ts_add_sns(ts, clk_map(ts));
+        }
         pthread_mutex_unlock(&ns_lock);
+    }
 
-        *ts = start_time;
+    return 0;
+}
+
+/*
+ * A slave joining a show already in progress learns its start time
+ * from the master's HELLO reply.  Return it once the clock has
+ * converged, so the player can seek to the current position.
+ */
+static int
+netsync_epoch(struct timespec *ts)
+{
+    struct timespec deadline;
+    int err;
+
+    if (slaves || !join_epoch.tv_sec)
+        return -1;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += SYNC_TIMEOUT;
+
+    pthread_mutex_lock(&ns_lock);
+    err = wait_synced(&deadline);
+    pthread_mutex_unlock(&ns_lock);
+
+    if (err) {
+        fprintf(stderr, "netsync: clock not settled after %d s\n",
+                SYNC_TIMEOUT);
+        return -1;
     }
 
+    *ts = join_epoch;
+
     return 0;
 }
 
+/*
+ * Position beacons: the master publishes the frames it shows, slaves
+ * hand the latest beacon to the player for drop/repeat correction.
+ */
+static void
+netsync_shown(unsigned frame, const struct timespec *ts)
+{
+    if (!slaves)
+        return;
+
+    pthread_mutex_lock(&ns_lock);
+    pos_frame = frame;
+    pos_time  = *ts;
+    pthread_mutex_unlock(&ns_lock);
+}
+
+static int
+netsync_master_pos(unsigned *frame, struct timespec *ts)
+{
+    static unsigned seen_seq;
+    int ret = -1;
+
+    pthread_mutex_lock(&ns_lock);
+    if (!slaves && pos_seq != seen_seq) {
+        *frame = pos_frame;
+        *ts    = pos_time;
+        seen_seq = pos_seq;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&ns_lock);
+
+    return ret;
+}
+
 static int
 netsync_read(struct timespec *ts)
 {
     clock_gettime(CLOCK_REALTIME, ts);
 
     if (!slaves) {
-        ts_sub(ts, &ping_time_local);
-        ts->tv_nsec += rtt / 2;
-        ts_add(ts, &ping_time_master);
+        pthread_mutex_lock(&ns_lock);
+        ts_add_sns(ts, clk_map(ts));
+        if (ts_sdiff_ns(ts, &last_read) < 0)
+            *ts = last_read;
+        else
+            last_read = *ts;
+        pthread_mutex_unlock(&ns_lock);
     }
 
     return 0;
@@ -573,9 +2130,9 @@ netsync_wait(struct timespec *ts)
     struct timespec nt = *ts;
 
     if (!slaves) {
-        ts_sub(&nt, &ping_time_master);
-        nt.tv_nsec += rtt / 2;
-        ts_add(&nt, &ping_time_local);
+        pthread_mutex_lock(&ns_lock);
+        clk_unmap(&nt);
+        pthread_mutex_unlock(&ns_lock);
     }
 
     sem_timedwait(&sleep_sem, &nt);
@@ -588,8 +2145,24 @@ netsync_close(void)
     ns_stop = 1;
     pthread_join(ns_thread, NULL);
 
+    if (bad_stamps)
+        fprintf(stderr, "netsync: %u exchanges dropped for missing "
+                "transmit stamps\n", bad_stamps);
+    bad_stamps = 0;
+
     close(sockfd);
+    sockfd = -1;
+    if (mc_fd != -1)
+        close(mc_fd);
+    mc_fd = -1;
+    free(slave_hash);
+    slave_hash = NULL;
     free(slaves);
+    slaves = NULL;
+    free(stats_file);
+    stats_file = NULL;
+    free(stats_tmp);
+    stats_tmp = NULL;
 
     pthread_mutex_destroy(&ns_lock);
     pthread_cond_destroy(&ns_cond);
@@ -602,6 +2175,9 @@ TIMER(netsync) = {
     .name  = "netsync",
     .open  = netsync_open,
     .start = netsync_start,
+    .epoch = netsync_epoch,
+    .shown = netsync_shown,
+    .master_pos = netsync_master_pos,
     .read  = netsync_read,
     .wait  = netsync_wait,
     .close = netsync_close,
@@ -0,0 +1,209 @@
+/*
+    Copyright (C) 2011 Mans Rullgard
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+    HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+#include "display.h"
+#include "memman.h"
+#include "timer.h"
+#include "util.h"
+
+static unsigned long vbl_period;
+static unsigned show_cost;
+static struct timespec vbl_base;
+static struct timespec last_flip;
+static unsigned long long vbl_first;
+static unsigned long long vbl_last;
+static unsigned num_shown;
+static unsigned min_gap;
+static unsigned max_gap;
+
+static int
+null_open(const char *arg, struct frame_format *dp, struct frame_format *ff)
+{
+    const char *p = arg;
+    unsigned rate = 0;
+    int len;
+
+    while (p && (len = strcspn(p, " ,;")) > 0) {
+        int c = p[0];
+
+        if (p[1] != '=')
+            goto argerr;
+
+        switch (c) {
+        case 'r':
+            rate = strtol(p + 2, NULL, 0);
+            break;
+        case 'c':
+            show_cost = strtol(p + 2, NULL, 0) * 1000;
+            if (show_cost >= 1000000000)
+                goto argerr;
+            break;
+        default:
+            goto argerr;
+        }
+
+        p += len + !!p[len];
+    }
+
+    vbl_period = rate? 1000000000 / rate: 0;
+
+    if (rate)
+        fprintf(stderr, "null: simulating %u Hz refresh\n", rate);
+
+    dp->width  = ff->disp_w;
+    dp->height = ff->disp_h;
+    dp->pixfmt = ff->pixfmt;
+
+    return 0;
+
+argerr:
+    fprintf(stderr, "null: params: r=refresh_rate c=show_cost_us\n");
+    return -1;
+}
+
+static int
+null_enable(struct frame_format *ff, unsigned flags,
+            const struct pixconv *pc, struct frame_format *df)
+{
+    clock_gettime(CLOCK_MONOTONIC, &vbl_base);
+    last_flip = vbl_base;
+    vbl_first = 0;
+    vbl_last  = 0;
+    num_shown = 0;
+    min_gap   = ~0U;
+    max_gap   = 0;
+
+    return 0;
+}
+
+static void
+null_prepare(struct frame *f)
+{
+}
+
+static void
+null_show(struct frame *f)
+{
+    struct timespec now, cur;
+    int virt;
+
+    /* charged to a virtual timer if there is one, else really spent */
+    virt = !ofbp_timer_advance(show_cost);
+    if (!virt && show_cost) {
+        struct timespec c = { 0, show_cost };
+        while (nanosleep(&c, &c) && errno == EINTR)
+            ;
+    }
+
+    /*
+     * With a virtual timer, vblanks are on its clock and waiting for
+     * one just moves it forward.
+     */
+    if (virt) {
+        ofbp_timer_read(&now);
+        if (!num_shown)
+            vbl_base = now;
+    } else {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    }
+
+    if (vbl_period) {
+        unsigned long long ns = (unsigned long long)
+            (now.tv_sec - vbl_base.tv_sec) * 1000000000 +
+            now.tv_nsec - vbl_base.tv_nsec;
+        unsigned long long vbl = ns / vbl_period + 1;
+        unsigned long long vns = vbl * vbl_period;
+
+        cur = now;
+        now.tv_sec  = vbl_base.tv_sec + vns / 1000000000;
+        now.tv_nsec = vbl_base.tv_nsec;
+        ts_add_ns(&now, vns % 1000000000);
+
+        if (virt)
+            ofbp_timer_advance(ts_diff_ns(&now, &cur));
+        else
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &now,
+                                   NULL) == EINTR)
+                ;
+
+        if (num_shown) {
+            unsigned gap = vbl - vbl_last;
+            min_gap = MIN(min_gap, gap);
+            max_gap = MAX(max_gap, gap);
+        } else {
+            vbl_first = vbl;
+        }
+
+        vbl_last = vbl;
+    }
+
+    last_flip = now;
+    num_shown++;
+
+    ofbp_put_frame(f);
+}
+
+static int
+null_feedback(struct timespec *flip, unsigned *period)
+{
+    if (!vbl_period || !num_shown)
+        return -1;
+
+    *flip   = last_flip;
+    *period = vbl_period;
+
+    return 0;
+}
+
+static void
+null_close(void)
+{
+    if (vbl_period && num_shown > 1)
+        fprintf(stderr, "null: %u frames in %llu vblanks, interval %u-%u\n",
+                num_shown, vbl_last - vbl_first, min_gap, max_gap);
+}
+
+static const struct memman null_mem = {
+    .name         = "null",
+    .alloc_frames = ofbp_sysmem_alloc,
+    .free_frames  = ofbp_sysmem_free,
+};
+
+DISPLAY(null) = {
+    .name    = "null",
+    .flags   = OFBP_PRIV_MEM | OFBP_ANY_MEM,
+    .open    = null_open,
+    .enable  = null_enable,
+    .prepare = null_prepare,
+    .show    = null_show,
+    .feedback = null_feedback,
+    .close   = null_close,
+    .memman  = &null_mem,
+};
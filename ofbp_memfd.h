@@ -0,0 +1,68 @@
+/*
+    Copyright (C) 2011 Mans Rullgard
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+    HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef OFBP_MEMFD_H
+#define OFBP_MEMFD_H
+
+#include <stdint.h>
+
+/*
+ * memfd frame export protocol
+ *
+ * Given a socket path, e.g. -M memfd:/tmp/ofbp.sock, the memfd and
+ * udmabuf memory managers listen on a SOCK_SEQPACKET unix socket there.
+ * Each client connecting is sent one struct ofbp_memfd_info followed by
+ * num_frames struct ofbp_memfd_frame messages, each with the file
+ * descriptor holding that frame attached as SCM_RIGHTS, after which the
+ * connection is closed.  A frame starts offset bytes into its
+ * descriptor, with the planes laid out as described by offsets[] and
+ * strides[].  Frame index n is frame number n in the player.
+ *
+ * memfd descriptors are read-only and sealed against resizing.
+ * udmabuf descriptors are dma-bufs, which cannot be reopened with
+ * fewer rights, so they are sent read-write.  A client writing to one
+ * changes the frame the player shows; use memfd for clients that are
+ * not trusted with that.
+ */
+
+#define OFBP_MEMFD_MAGIC   0x6d62666f     /* "ofbm" */
+#define OFBP_MEMFD_VERSION 1
+
+struct ofbp_memfd_info {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_frames;
+    uint32_t width, height;
+    int32_t  pixfmt;
+    uint32_t frame_size;
+    uint32_t offsets[3];
+    uint32_t strides[3];
+};
+
+struct ofbp_memfd_frame {
+    uint32_t index;
+    uint32_t offset;
+};
+
+#endif /* OFBP_MEMFD_H */
@@ -0,0 +1,84 @@
+/*
+    Copyright (C) 2011 Mans Rullgard
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+    HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef OFBP_SHM_H
+#define OFBP_SHM_H
+
+#include <stdint.h>
+
+/*
+ * Shared memory display protocol
+ *
+ * The shared memory object starts with a struct ofbp_shm_header
+ * followed by num_slots ring entries.  Frame data begins at
+ * data_offset, each frame occupying frame_size bytes, with the planes
+ * laid out as described by offsets[] and strides[].
+ *
+ * For every frame shown, the player fills in the slot at index
+ * seq % num_slots, then stores seq and wakes any futex waiters on it.
+ * The slot's pts_sec and pts_nsec hold the CLOCK_MONOTONIC time at
+ * which the frame was shown.
+ * The consumer must treat the frame as read-only.  Once it no longer
+ * needs all frames up to and including sequence number n, it advances
+ * ack to n and does a FUTEX_WAKE on that word.  The player may advance
+ * ack too (see below), so the consumer must do so with a
+ * compare-and-swap loop, and only ever move ack forward: if ack is
+ * already at or beyond n, it leaves it alone.  Frames are only reused
+ * by the player after they have been acknowledged.
+ *
+ * A frame not acknowledged within 200 ms of being shown is reclaimed
+ * anyway: the player advances ack past it itself and reuses the frame.
+ * A consumer finding ack already at or beyond a sequence number it is
+ * still reading must assume that frame has been overwritten.
+ */
+
+#define OFBP_SHM_MAGIC   0x7062666f     /* "ofbp" */
+#define OFBP_SHM_VERSION 1
+
+struct ofbp_shm_slot {
+    uint32_t seq;
+    uint32_t frame;
+    uint32_t pts_sec;
+    uint32_t pts_nsec;
+};
+
+struct ofbp_shm_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_frames;
+    uint32_t num_slots;
+    uint32_t width, height;
+    uint32_t disp_x, disp_y;
+    uint32_t disp_w, disp_h;
+    int32_t  pixfmt;
+    uint32_t frame_size;
+    uint32_t data_offset;
+    uint32_t offsets[3];
+    uint32_t strides[3];
+    volatile uint32_t seq;
+    volatile uint32_t ack;
+    struct ofbp_shm_slot slots[];
+};
+
+#endif /* OFBP_SHM_H */
@@ -27,6 +27,7 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
 
@@ -55,6 +56,8 @@ static int vid_fd = -1;
 static int fb_page_flip;
 static int fb_page;
 static const struct pixconv *pixconv;
+static struct timespec flip_time;
+static unsigned vbl_period;
 
 #define xioctl(fd, req, param) do {             \
         if (ioctl(fd, req, param) == -1)        \
@@ -189,6 +192,13 @@ omapfb_enable(struct frame_format *ff, unsigned flags,
         xioctl(gfx_fd, OMAPFB_SETUP_PLANE, &pi);
     }
 
+    vbl_period = (unsigned long long)gfx_sinfo.pixclock *
+        (gfx_sinfo.xres + gfx_sinfo.left_margin +
+         gfx_sinfo.right_margin + gfx_sinfo.hsync_len) *
+        (gfx_sinfo.yres + gfx_sinfo.upper_margin +
+         gfx_sinfo.lower_margin + gfx_sinfo.vsync_len) / 1000;
+    flip_time.tv_sec = 0;
+
     pixconv = pc;
 
     return 0;
@@ -222,12 +232,24 @@ static void omapfb_show(struct frame *f)
         vid_sinfo.yoffset = fb_pages[fb_page].y;
         ioctl(vid_fd, FBIOPAN_DISPLAY, &vid_sinfo);
         fb_page ^= fb_page_flip;
-        ioctl(vid_fd, OMAPFB_WAITFORGO);
+        if (!ioctl(vid_fd, OMAPFB_WAITFORGO))
+            clock_gettime(CLOCK_MONOTONIC, &flip_time);
     }
 
     ofbp_put_frame(f);
 }
 
+static int omapfb_feedback(struct timespec *flip, unsigned *period)
+{
+    if (!flip_time.tv_sec)
+        return -1;
+
+    *flip   = flip_time;
+    *period = vbl_period;
+
+    return 0;
+}
+
 static void omapfb_close(void)
 {
     ioctl(gfx_fd, OMAPFB_SETUP_PLANE, &gfx_pinfo);
@@ -247,5 +269,6 @@ DISPLAY(omapfb) = {
     .enable  = omapfb_enable,
     .prepare = omapfb_prepare,
     .show  = omapfb_show,
+    .feedback = omapfb_feedback,
     .close = omapfb_close,
 };
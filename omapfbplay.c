@@ -32,6 +32,8 @@
 #include <errno.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
@@ -45,8 +47,12 @@
 #include "frame.h"
 #include "pixfmt.h"
 #include "pixconv.h"
+#include "thread.h"
 
 #define BUFFER_SIZE (64*1024*1024)
+#define PACKET_QUEUE 64
+#define JOIN_PREROLL 2000000000LL
+#define SYNC_SLACK 2000000
 
 static AVFormatContext *
 open_file(const char *filename)
@@ -172,36 +178,64 @@ static int disp_tail = -1;
 static int disp_count;
 
 static pthread_mutex_t disp_lock;
+static pthread_mutex_t frame_lock = PTHREAD_MUTEX_INITIALIZER;
 static sem_t disp_sem;
 static sem_t free_sem;
 
 static int stop;
+static int stop_fd = -1;
 
 static int noaspect;
 
+static AVPacket pkt_queue[PACKET_QUEUE];
+static int pkt_stream;
+static int pkt_head;
+static int pkt_count;
+static int pkt_eof;
+static pthread_mutex_t pkt_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pkt_cond = PTHREAD_COND_INITIALIZER;
+
+static int join_seek;
+static int64_t start_frame;
+
 struct frame *ofbp_get_frame(void)
 {
-    struct frame *f = frames + free_tail;
+    struct frame *f;
 
     sem_wait(&free_sem);
 
+    pthread_mutex_lock(&frame_lock);
+
     if (free_tail < 0) {
+        pthread_mutex_unlock(&frame_lock);
         fprintf(stderr, "no more buffers\n");
         return NULL;
     }
 
+    f = frames + free_tail;
     free_tail = f->next;
     frames[free_tail].prev = -1;
     f->next = -1;
     f->refs++;
 
+    pthread_mutex_unlock(&frame_lock);
+
     return f;
 }
 
+void ofbp_ref_frame(struct frame *f)
+{
+    pthread_mutex_lock(&frame_lock);
+    f->refs++;
+    pthread_mutex_unlock(&frame_lock);
+}
+
 void ofbp_put_frame(struct frame *f)
 {
     unsigned fnum = f->frame_num;
 
+    pthread_mutex_lock(&frame_lock);
+
     if (!--f->refs) {
         f->prev = free_head;
         if (free_head != -1)
@@ -209,6 +243,80 @@ void ofbp_put_frame(struct frame *f)
         free_head = fnum;
         sem_post(&free_sem);
     }
+
+    pthread_mutex_unlock(&frame_lock);
+}
+
+int ofbp_timer_advance(unsigned nsec)
+{
+    if (!timer || !timer->advance)
+        return -1;
+
+    return timer->advance(nsec);
+}
+
+int ofbp_timer_read(struct timespec *ts)
+{
+    if (!timer)
+        return -1;
+
+    return timer->read(ts);
+}
+
+static unsigned refresh_period;
+static FILE *present_log;
+
+/*
+ * Return the display refresh period in ns, 0 if unknown.  If the
+ * display reports flip times, *flip is set to the most recent one,
+ * converted to the timer's clock, otherwise it is zeroed.  A virtual
+ * timer has no fixed relation to CLOCK_MONOTONIC, so a display
+ * simulating vsync under one reports flips in the timer's clock.
+ */
+static unsigned
+vblank_info(struct timespec *flip)
+{
+    struct timespec mono, now;
+    unsigned period = 0;
+
+    if (!display->feedback || display->feedback(flip, &period)) {
+        flip->tv_sec  = 0;
+        flip->tv_nsec = 0;
+        return refresh_period;
+    }
+
+    if (refresh_period)
+        period = refresh_period;
+
+    if (!period) {
+        flip->tv_sec  = 0;
+        flip->tv_nsec = 0;
+        return 0;
+    }
+
+    if (!timer->advance) {
+        timer->read(&now);
+        clock_gettime(CLOCK_MONOTONIC, &mono);
+        ts_sub(&now, &mono);
+        ts_add(flip, &now);
+    }
+
+    return period;
+}
+
+/*
+ * Move *ts onto the nearest vblank of the grid through *flip.
+ */
+static void
+vblank_snap(struct timespec *ts, const struct timespec *flip, unsigned period)
+{
+    long long d = ts_sdiff_ns(ts, flip);
+
+    if (d < 0 || d > 1000000000)
+        return;
+
+    *ts = *flip;
+    ts_add_sns(ts, (d + period / 2) / period * period);
 }
 
 static void *
@@ -217,16 +325,30 @@ disp_thread(void *p)
     AVStream *st = p;
     unsigned long fper =
         1000000000ull * st->r_frame_rate.den / st->r_frame_rate.num;
-    struct timespec ftime;
+    struct timespec ftime, wtime, vtime;
     struct timespec tstart, t1, t2;
+    struct timespec flip;
+    unsigned period, cad_period = 0;
+    unsigned long cad_acc = 0;
     int nf1 = 0, nf2 = 0;
+    int catchup = 1, nskip = 0;
+    unsigned fnum = start_frame;
+    unsigned mframe;
+    struct timespec mtime;
+    int ndrop = 0, nrepeat = 0;
+    long long max_err = 0;
     int sval;
+    int tfd;
+
+    ofbp_thread_setup(OFBP_THREAD_DISPLAY);
 
     while (sem_getvalue(&free_sem, &sval), sval && !stop)
         usleep(100000);
 
     timer->start(&tstart);
     ftime = t1 = tstart;
+    ts_add_sns(&ftime, start_frame * fper);
+    vtime = ftime;
 
     while (!sem_wait(&disp_sem) && !stop) {
         struct frame *f;
@@ -241,10 +363,125 @@ disp_thread(void *p)
 
         f->next = -1;
 
+        /* when joining a running show, drop frames until on schedule */
+        if (catchup) {
+            timer->read(&t2);
+            if (ts_sdiff_ns(&t2, &ftime) > (long long)fper) {
+                ofbp_put_frame(f);
+                ts_add_ns(&ftime, fper);
+                fnum++;
+                nskip++;
+                continue;
+            }
+            if (nskip)
+                fprintf(stderr, "Skipped %d frames to catch up\n", nskip);
+            vtime = ftime;
+            catchup = 0;
+        }
+
+        /*
+         * Compare our schedule with the master's latest position
+         * beacon and drop or repeat one frame if it is more than half
+         * a frame off.
+         */
+        if (timer->master_pos && !timer->master_pos(&mframe, &mtime)) {
+            long long err = ts_sdiff_ns(&ftime, &mtime) -
+                (long long)(int)(fnum - mframe) * (long long)fper;
+            long long tol = fper / 2 + SYNC_SLACK;
+
+            if (llabs(err) > llabs(max_err))
+                max_err = err;
+
+            if (err > tol) {
+                ofbp_put_frame(f);
+                fnum++;
+                ndrop++;
+                continue;
+            }
+
+            if (err < -tol) {
+                ts_add_ns(&ftime, fper);
+                ts_add_ns(&vtime, fper);
+                nrepeat++;
+            }
+        }
+
         display->prepare(f);
-        timer->wait(&ftime);
+
+        period = vblank_info(&flip);
+        if (period != cad_period) {
+            if (period)
+                fprintf(stderr, "refresh %u.%03u Hz, %lu.%03lu vblanks/frame\n",
+                        1000000000 / period,
+                        (unsigned)(1000000000000ull / period % 1000),
+                        fper / period, fper % period * 1000 / period);
+            cad_period = period;
+            cad_acc = period / 2;
+            vtime = ftime;
+        }
+
+        /*
+         * With a known refresh period, frames are shown on the vblanks
+         * tracked in vtime.  When flip times are available, wake half a
+         * refresh before the target vblank so timer jitter cannot push
+         * the flip onto a neighbouring one.
+         */
+        if (cad_period) {
+            wtime = vtime;
+            if (flip.tv_sec) {
+                struct timespec half = { 0, cad_period / 2 };
+                vblank_snap(&wtime, &flip, cad_period);
+                vtime = wtime;
+                ts_sub(&wtime, &half);
+            }
+        } else {
+            wtime = ftime;
+        }
+
+        /*
+         * Timers with a pollable deadline let a stop request cut the
+         * wait short.
+         */
+        if (timer->wait_fd && (tfd = timer->wait_fd(&wtime)) != -1) {
+            struct pollfd pfd[2] = {
+                { .fd = tfd,     .events = POLLIN },
+                { .fd = stop_fd, .events = POLLIN },
+            };
+
+            while (poll(pfd, 2, -1) < 0 && errno == EINTR)
+                ;
+
+            if (pfd[1].revents) {
+                ofbp_put_frame(f);
+                break;
+            }
+        }
+
+        timer->wait(&wtime);
         display->show(f);
 
+        if (timer->shown)
+            timer->shown(fnum, &ftime);
+
+        /*
+         * Log when each frame reached the screen, by the display's
+         * flip time if it reports one, for comparing nodes.
+         */
+        if (present_log) {
+            struct timespec mono, pt;
+            unsigned p;
+
+            if (!display->feedback || display->feedback(&mono, &p))
+                clock_gettime(CLOCK_MONOTONIC, &mono);
+            timer->read(&pt);
+
+            fprintf(present_log, "%u %ld.%09ld %ld.%09ld\n", fnum,
+                    (long)mono.tv_sec, mono.tv_nsec,
+                    (long)pt.tv_sec, pt.tv_nsec);
+        }
+
+        fnum++;
+
         if (++nf1 - nf2 == 50) {
             timer->read(&t2);
             fprintf(stderr, "%3d fps, buffer %3d\r",
@@ -256,10 +493,35 @@ disp_thread(void *p)
 
         ts_add_ns(&ftime, fper);
 
+        /*
+         * Give each frame a whole number of refresh intervals.  The
+         * accumulator yields a fixed pattern such as 3:2 for 24p on
+         * 60 Hz; a vblank is only added or dropped once the display
+         * has drifted more than a full refresh from the frame clock.
+         */
+        if (cad_period) {
+            unsigned n;
+            long long err;
+
+            cad_acc += fper;
+            n = cad_acc / cad_period;
+            cad_acc -= n * cad_period;
+
+            err = ts_sdiff_ns(&ftime, &vtime) - (long long)n * cad_period;
+            if (err > cad_period)
+                n++;
+            else if (err < -(long long)cad_period && n > 1)
+                n--;
+
+            ts_add_ns(&vtime, n * cad_period);
+        }
+
         timer->read(&t2);
         if (t2.tv_sec > ftime.tv_sec ||
-            (t2.tv_sec == ftime.tv_sec && t2.tv_nsec > ftime.tv_nsec))
-            ftime = t2;
+            (t2.tv_sec == ftime.tv_sec && t2.tv_nsec > ftime.tv_nsec)) {
+            ftime = vtime = t2;
+            cad_acc = cad_period / 2;
+        }
     }
 
     if (nf1) {
@@ -267,6 +529,10 @@ disp_thread(void *p)
         fprintf(stderr, "%3d fps\n", nf1*1000 / ts_diff_ms(&t2, &tstart));
     }
 
+    if (timer->master_pos)
+        fprintf(stderr, "sync: %d frames dropped, %d repeated, "
+                "max error %lld us\n", ndrop, nrepeat, max_err / 1000);
+
     while (disp_tail != -1) {
         struct frame *f = frames + disp_tail;
         disp_tail = f->next;
@@ -276,6 +542,107 @@ disp_thread(void *p)
     return NULL;
 }
 
+static void *
+demux_thread(void *p)
+{
+    AVFormatContext *afc = p;
+    AVPacket pk;
+
+    ofbp_thread_setup(OFBP_THREAD_DEMUX);
+
+    while (!stop && !av_read_frame(afc, &pk)) {
+        if (pk.stream_index != pkt_stream || av_dup_packet(&pk)) {
+            av_free_packet(&pk);
+            continue;
+        }
+
+        /* the first packet after a join seek sets the frame number */
+        if (join_seek) {
+            AVStream *st = afc->streams[pkt_stream];
+            int64_t pts = pk.pts != AV_NOPTS_VALUE? pk.pts: pk.dts;
+
+            if (pts != AV_NOPTS_VALUE) {
+                if (st->start_time != AV_NOPTS_VALUE)
+                    pts -= st->start_time;
+                start_frame = av_rescale_q(pts, st->time_base,
+                                           (AVRational){ st->r_frame_rate.den,
+                                                         st->r_frame_rate.num });
+            }
+
+            join_seek = 0;
+        }
+
+        pthread_mutex_lock(&pkt_lock);
+        while (pkt_count == PACKET_QUEUE && !stop)
+            pthread_cond_wait(&pkt_cond, &pkt_lock);
+        if (stop) {
+            pthread_mutex_unlock(&pkt_lock);
+            av_free_packet(&pk);
+            break;
+        }
+        pkt_queue[(pkt_head + pkt_count++) % PACKET_QUEUE] = pk;
+        pthread_cond_broadcast(&pkt_cond);
+        pthread_mutex_unlock(&pkt_lock);
+    }
+
+    pthread_mutex_lock(&pkt_lock);
+    pkt_eof = 1;
+    pthread_cond_broadcast(&pkt_cond);
+    pthread_mutex_unlock(&pkt_lock);
+
+    return NULL;
+}
+
+/*
+ * Seek to where a show already in progress will be once buffers have
+ * filled.  Whatever the seek misses is dropped by disp_thread().
+ */
+static void
+join_show(AVFormatContext *afc, AVStream *st, const struct timespec *epoch)
+{
+    struct timespec now;
+    int64_t pos;
+
+    timer->read(&now);
+    pos = (ts_sdiff_ns(&now, epoch) + JOIN_PREROLL) / 1000;
+    if (pos <= 0)
+        return;
+
+    fprintf(stderr, "Joining show at %lld.%03lld s\n",
+            (long long)pos / 1000000, (long long)pos / 1000 % 1000);
+
+    pos = av_rescale_q(pos, AV_TIME_BASE_Q, st->time_base);
+    if (st->start_time != AV_NOPTS_VALUE)
+        pos += st->start_time;
+
+    if (av_seek_frame(afc, st->index, pos, AVSEEK_FLAG_BACKWARD) < 0) {
+        fprintf(stderr, "Seek failed, catching up from the start\n");
+        return;
+    }
+
+    join_seek = 1;
+}
+
+static int
+get_packet(AVPacket *pk)
+{
+    int ret = -1;
+
+    pthread_mutex_lock(&pkt_lock);
+    while (!pkt_count && !pkt_eof)
+        pthread_cond_wait(&pkt_cond, &pkt_lock);
+    if (pkt_count) {
+        *pk = pkt_queue[pkt_head];
+        pkt_head = (pkt_head + 1) % PACKET_QUEUE;
+        pkt_count--;
+        pthread_cond_broadcast(&pkt_cond);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&pkt_lock);
+
+    return ret;
+}
+
 void ofbp_post_frame(struct frame *f)
 {
     unsigned fnum = f->frame_num;
@@ -293,7 +660,7 @@ void ofbp_post_frame(struct frame *f)
     disp_count++;
     pthread_mutex_unlock(&disp_lock);
 
-    f->refs++;
+    ofbp_ref_frame(f);
 
     if (disp_count > 1)
         sem_post(&disp_sem);
@@ -371,10 +738,18 @@ static void set_scale(struct frame_format *df, const struct frame_format *ff,
 }
 
 static void
-sigint(int s)
+stop_disp(void)
 {
     stop = 1;
     sem_post(&disp_sem);
+    if (stop_fd != -1)
+        eventfd_write(stop_fd, 1);
+}
+
+static void
+sigint(int s)
+{
+    stop_disp();
 }
 
 #define TPVAL(i, sub) (i & (0x100 >> sub)? 255 - (i << sub) : (i << sub))
@@ -458,8 +833,14 @@ speed_test(const char *drv, const char *mem, const char *conv,
         ff.pixfmt = dp.pixfmt;
     }
 
+    if (!memman) {
+        const char *param = NULL;
+        memman = find_driver(mem, &param, ofbp_memman_start);
+        if (memman && memman->open && memman->open(param))
+            return 1;
+    }
     if (!memman)
-        memman = find_driver(mem, NULL, ofbp_memman_start);
+        return 1;
 
     if (memman->alloc_frames(&ff, 0, &frames, &num_frames))
         return 1;
@@ -499,6 +880,7 @@ speed_test(const char *drv, const char *mem, const char *conv,
     fprintf(stderr, "%d ms, %d fps, read %lld B/s, write %lld B/s\n",
             j, i*1000 / j, 1000LL*i*bufsize / j, 2000LL*i*w*h / j);
 
+    if (display->flush) display->flush();
     memman->free_frames(frames, num_frames);
     display->close();
     if (pixconv) pixconv->close();
@@ -519,6 +901,7 @@ main(int argc, char **argv)
     struct frame_format dp;
     int bufsize = BUFFER_SIZE;
     pthread_t dispt;
+    pthread_t demuxt;
     unsigned flags = OFBP_DOUBLE_BUF;
     char *test_param = NULL;
     char *dispdrv = NULL;
@@ -531,7 +914,7 @@ main(int argc, char **argv)
 
 #define error(n) do { ret = n; goto out; } while (0)
 
-    while ((opt = getopt(argc, argv, "b:d:fFM:P:st:T:v:")) != -1) {
+    while ((opt = getopt(argc, argv, "b:d:fFL:M:P:r:sS:t:T:v:")) != -1) {
         switch (opt) {
         case 'b':
             bufsize = strtol(optarg, NULL, 0) * 1048576;
@@ -544,15 +927,31 @@ main(int argc, char **argv)
         case 'f':
             flags |= OFBP_FULLSCREEN;
             break;
+        case 'L':
+            present_log = fopen(optarg, "w");
+            if (!present_log) {
+                perror(optarg);
+                return 1;
+            }
+            break;
         case 'M':
             memman_drv = optarg;
             break;
         case 'P':
             pixconv_drv = optarg;
             break;
+        case 'r': {
+            double hz = strtod(optarg, NULL);
+            refresh_period = hz > 0 ? 1e9 / hz : 0;
+            break;
+        }
         case 's':
             flags &= ~OFBP_DOUBLE_BUF;
             break;
+        case 'S':
+            if (ofbp_thread_opt(optarg))
+                return 1;
+            break;
         case 't':
             test_param = optarg;
             break;
@@ -601,6 +1000,9 @@ main(int argc, char **argv)
         error(1);
     }
 
+    frame_fmt.rate_num = st->r_frame_rate.num;
+    frame_fmt.rate_den = st->r_frame_rate.den;
+
     dp.pixfmt = frame_fmt.pixfmt;
     display = display_open(dispdrv, &dp, &frame_fmt);
     if (!display)
@@ -617,8 +1019,12 @@ main(int argc, char **argv)
         }
     }
 
-    if (!memman)
-        memman = find_driver(memman_drv, NULL, ofbp_memman_start);
+    if (!memman) {
+        const char *param = NULL;
+        memman = find_driver(memman_drv, &param, ofbp_memman_start);
+        if (memman && memman->open && memman->open(param))
+            error(1);
+    }
     if (!memman)
         error(1);
 
@@ -645,6 +1051,12 @@ main(int argc, char **argv)
     if (!timer)
         error(1);
 
+    if (timer->epoch) {
+        struct timespec epoch;
+        if (!timer->epoch(&epoch))
+            join_show(afc, st, &epoch);
+    }
+
     init_frames(&frame_fmt);
 
     if (display->enable(&frame_fmt, flags, pixconv, &dp))
@@ -652,15 +1064,19 @@ main(int argc, char **argv)
 
     pthread_mutex_init(&disp_lock, NULL);
     sem_init(&disp_sem, 0, 0);
+    stop_fd = eventfd(0, EFD_CLOEXEC);
 
     signal(SIGINT, sigint);
 
     pthread_create(&dispt, NULL, disp_thread, st);
+    pkt_stream = st->index;
+    pthread_create(&demuxt, NULL, demux_thread, afc);
 
-    while (!stop && !av_read_frame(afc, &pk)) {
-        if (pk.stream_index == st->index)
-            if (codec->decode(&pk))
-                stop = 1;
+    ofbp_thread_setup(OFBP_THREAD_DECODE);
+
+    while (!stop && !get_packet(&pk)) {
+        if (codec->decode(&pk))
+            stop = 1;
         av_free_packet(&pk);
     }
 
@@ -670,18 +1086,29 @@ main(int argc, char **argv)
             usleep(100000);
     }
 
-    stop = 1;
-    sem_post(&disp_sem);
+    stop_disp();
     pthread_join(dispt, NULL);
 
+    pthread_mutex_lock(&pkt_lock);
+    pthread_cond_broadcast(&pkt_cond);
+    pthread_mutex_unlock(&pkt_lock);
+    pthread_join(demuxt, NULL);
+
+    while (!get_packet(&pk))
+        av_free_packet(&pk);
+
 out:
     if (afc) av_close_input_file(afc);
 
     if (codec)   codec->close();
     if (timer)   timer->close();
+    if (display && display->flush) display->flush();
     if (memman)  memman->free_frames(frames, num_frames);
     if (display) display->close();
     if (pixconv) pixconv->close();
 
+    if (present_log) fclose(present_log);
+    if (stop_fd != -1) close(stop_fd);
+
     return ret;
 }
@@ -34,7 +34,54 @@ static const struct pixfmt pixfmt_tab[] = {
         .inc   = { 1, 1, 1 },
         .hsub  = { 0, 1, 1 },
         .vsub  = { 0, 1, 1 },
+        .bps   = 1,
     },
+    {
+        .fmt   = PIX_FMT_YUV422P,
+        .plane = { 0, 1, 2 },
+        .inc   = { 1, 1, 1 },
+        .hsub  = { 0, 1, 1 },
+        .vsub  = { 0, 0, 0 },
+        .bps   = 1,
+    },
+    {
+        .fmt   = PIX_FMT_YUV444P,
+        .plane = { 0, 1, 2 },
+        .inc   = { 1, 1, 1 },
+        .hsub  = { 0, 0, 0 },
+        .vsub  = { 0, 0, 0 },
+        .bps   = 1,
+    },
+#ifdef PIX_FMT_YUV420P10
+    {
+        .fmt   = PIX_FMT_YUV420P10,
+        .plane = { 0, 1, 2 },
+        .inc   = { 2, 2, 2 },
+        .hsub  = { 0, 1, 1 },
+        .vsub  = { 0, 1, 1 },
+        .bps   = 2,
+    },
+#endif
+#ifdef PIX_FMT_YUV422P10
+    {
+        .fmt   = PIX_FMT_YUV422P10,
+        .plane = { 0, 1, 2 },
+        .inc   = { 2, 2, 2 },
+        .hsub  = { 0, 1, 1 },
+        .vsub  = { 0, 0, 0 },
+        .bps   = 2,
+    },
+#endif
+#ifdef PIX_FMT_YUV444P10
+    {
+        .fmt   = PIX_FMT_YUV444P10,
+        .plane = { 0, 1, 2 },
+        .inc   = { 2, 2, 2 },
+        .hsub  = { 0, 0, 0 },
+        .vsub  = { 0, 0, 0 },
+        .bps   = 2,
+    },
+#endif
     {
         .fmt   = PIX_FMT_YUYV422,
         .plane = { 0, 0, 0 },
@@ -42,6 +89,7 @@ static const struct pixfmt pixfmt_tab[] = {
         .inc   = { 2, 4, 4 },
         .hsub  = { 0, 1, 1 },
         .vsub  = { 0, 0, 0 },
+        .bps   = 1,
     },
     {
         .fmt   = PIX_FMT_NV12,
@@ -50,6 +98,7 @@ static const struct pixfmt pixfmt_tab[] = {
         .inc   = { 1, 2, 2 },
         .hsub  = { 0, 1, 1 },
         .vsub  = { 0, 1, 1 },
+        .bps   = 1,
     },
 };
 
@@ -71,3 +120,32 @@ void ofbp_get_plane_offsets(int offs[3], const struct pixfmt *p,
     for (i = 0; i < 3; i++)
         offs[i] = (y>>p->vsub[i]) * stride[i] + (x>>p->hsub[i]) * p->inc[i];
 }
+
+unsigned ofbp_get_plane_layout(int offs[3], int stride[3],
+                               const struct pixfmt *p, int w, int h)
+{
+    int height[3] = { 0 };
+    unsigned size = 0;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        offs[i]   = 0;
+        stride[i] = 0;
+    }
+
+    for (i = 0; i < 3; i++) {
+        int n = p->plane[i];
+        int s = ALIGN((w >> p->hsub[i]) * p->inc[i], 16);
+        stride[n] = MAX(stride[n], s);
+        height[n] = MAX(height[n], h >> p->vsub[i]);
+    }
+
+    for (i = 0; i < 3; i++) {
+        if (!stride[i])
+            continue;
+        offs[i] = size;
+        size += stride[i] * height[i];
+    }
+
+    return size;
+}
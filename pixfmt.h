@@ -34,10 +34,13 @@ struct pixfmt {
     int inc[3];
     int hsub[3];
     int vsub[3];
+    int bps;
 };
 
 const struct pixfmt *ofbp_get_pixfmt(enum PixelFormat fmt);
 void ofbp_get_plane_offsets(int offs[3], const struct pixfmt *p,
                             int x, int y, const int stride[3]);
+unsigned ofbp_get_plane_layout(int offs[3], int stride[3],
+                               const struct pixfmt *p, int w, int h);
 
 #endif
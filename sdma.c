@@ -62,6 +62,9 @@ static int sdma_open(const struct frame_format *ff,
     unsigned dw = 2 * ff->disp_w;
     int i;
 
+    if (ff->pixfmt != PIX_FMT_YUV420P || df->pixfmt != PIX_FMT_YUYV422)
+        return -1;
+
     if (SDMA_init())
         return -1;
 
@@ -0,0 +1,325 @@
+/*
+    Copyright (C) 2011 Mans Rullgard
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+    HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "display.h"
+#include "memman.h"
+#include "pixfmt.h"
+#include "ofbp_shm.h"
+#include "util.h"
+
+#define REAP_TIMEOUT 100000000
+#define ACK_TIMEOUT  200000000
+
+static const char *shm_name;
+static int shm_fd = -1;
+static struct ofbp_shm_header *hdr;
+static unsigned shm_size;
+static struct frame *frames;
+static unsigned num_frames;
+static uint32_t reaped;
+static unsigned dropped;
+
+static pthread_t reap_thread;
+static int reap_running;
+static int reap_stop;
+
+static int
+futex(volatile uint32_t *addr, int op, uint32_t val,
+      const struct timespec *ts)
+{
+    return syscall(SYS_futex, addr, op, val, ts, NULL, 0);
+}
+
+static long long
+slot_age(const struct ofbp_shm_slot *s)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - (long long)s->pts_sec) * 1000000000LL +
+        now.tv_nsec - (long long)s->pts_nsec;
+}
+
+/*
+ * Return acknowledged frames to the pool.  ofbp_put_frame() is safe to
+ * call from here as the pool is guarded by its own lock.  A frame left
+ * unacknowledged for ACK_TIMEOUT is taken back anyway by advancing ack
+ * on the consumer's behalf, so playback keeps going with a slow or
+ * absent consumer.  Should ack still move backwards, nothing before
+ * reaped is returned twice.
+ */
+static void *
+shm_reaper(void *p)
+{
+    while (!reap_stop) {
+        struct timespec ts = { 0, REAP_TIMEOUT };
+        uint32_t cur = hdr->ack;
+        uint32_t seq = hdr->seq;
+        uint32_t ack = cur;
+
+        if ((int32_t)(ack - seq) > 0)
+            ack = seq;
+        if ((int32_t)(ack - reaped) < 0)
+            ack = reaped;
+
+        while (reaped != ack) {
+            reaped++;
+            ofbp_put_frame(&frames[hdr->slots[reaped % num_frames].frame]);
+        }
+
+        if (seq != ack) {
+            long long age = slot_age(&hdr->slots[(ack + 1) % num_frames]);
+
+            if (age >= ACK_TIMEOUT) {
+                if (__sync_bool_compare_and_swap(&hdr->ack, cur, ack + 1))
+                    dropped++;
+                continue;
+            }
+
+            ts.tv_nsec = MIN(ACK_TIMEOUT - age, REAP_TIMEOUT);
+        }
+
+        futex(&hdr->ack, FUTEX_WAIT, cur, &ts);
+    }
+
+    return NULL;
+}
+
+static int
+shm_alloc_frames(struct frame_format *ff, unsigned bufsize,
+                 struct frame **fr, unsigned *nf)
+{
+    const struct pixfmt *pf = ofbp_get_pixfmt(ff->pixfmt);
+    unsigned page_size = sysconf(_SC_PAGESIZE);
+    unsigned frame_size;
+    unsigned data_offset;
+    int offs[3], stride[3];
+    uint8_t *data;
+    int i, j;
+
+    if (!pf) {
+        fprintf(stderr, "shm: unsupported pixel format %d\n", ff->pixfmt);
+        return -1;
+    }
+
+    frame_size = ofbp_get_plane_layout(offs, stride, pf,
+                                       ff->width, ff->height);
+    frame_size = ALIGN(frame_size, page_size);
+    num_frames = MAX(bufsize / frame_size, MIN_FRAMES);
+
+    data_offset = sizeof(*hdr) + num_frames * sizeof(hdr->slots[0]);
+    data_offset = ALIGN(data_offset, page_size);
+    shm_size = data_offset + num_frames * frame_size;
+
+    fprintf(stderr, "shm: %s, %d frame buffers, frame_size=%d\n",
+            shm_name, num_frames, frame_size);
+
+    if (ftruncate(shm_fd, shm_size)) {
+        fprintf(stderr, "Error allocating frame buffers: %d bytes\n",
+                shm_size);
+        return -1;
+    }
+
+    hdr = mmap(NULL, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+               shm_fd, 0);
+    if (hdr == MAP_FAILED) {
+        perror("mmap");
+        hdr = NULL;
+        return -1;
+    }
+
+    frames = calloc(num_frames, sizeof(*frames));
+    if (!frames) {
+        munmap(hdr, shm_size);
+        hdr = NULL;
+        return -1;
+    }
+
+    hdr->num_frames  = num_frames;
+    hdr->num_slots   = num_frames;
+    hdr->width       = ff->width;
+    hdr->height      = ff->height;
+    hdr->pixfmt      = ff->pixfmt;
+    hdr->frame_size  = frame_size;
+    hdr->data_offset = data_offset;
+
+    for (j = 0; j < 3; j++) {
+        hdr->offsets[j] = offs[j];
+        hdr->strides[j] = stride[j];
+    }
+
+    data = (uint8_t *)hdr + data_offset;
+
+    for (i = 0; i < num_frames; i++) {
+        uint8_t *p = data + i * frame_size;
+
+        frames[i].ff = ff;
+        for (j = 0; j < 3; j++) {
+            frames[i].virt[j]     = p + offs[j];
+            frames[i].linesize[j] = stride[j];
+        }
+        frames[i].fd     = shm_fd;
+        frames[i].offset = data_offset + i * frame_size;
+    }
+
+    ff->y_stride  = stride[0];
+    ff->uv_stride = stride[1];
+
+    *fr = frames;
+    *nf = num_frames;
+
+    return 0;
+}
+
+static void
+shm_free_frames(struct frame *fr, unsigned nf)
+{
+    if (reap_running) {
+        reap_stop = 1;
+        pthread_join(reap_thread, NULL);
+        reap_running = 0;
+    }
+
+    if (dropped)
+        fprintf(stderr, "shm: %u frames reclaimed without ack\n", dropped);
+
+    if (hdr) {
+        hdr->magic = 0;
+        munmap(hdr, shm_size);
+        hdr = NULL;
+    }
+
+    free(frames);
+    frames = NULL;
+}
+
+static int
+shm_open_disp(const char *name, struct frame_format *dp,
+              struct frame_format *ff)
+{
+    shm_name = name? name: "/omapfbplay";
+
+    shm_fd = shm_open(shm_name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (shm_fd == -1) {
+        perror(shm_name);
+        return -1;
+    }
+
+    dp->width  = ff->disp_w;
+    dp->height = ff->disp_h;
+    dp->pixfmt = ff->pixfmt;
+
+    return 0;
+}
+
+static int
+shm_enable(struct frame_format *ff, unsigned flags,
+           const struct pixconv *pc, struct frame_format *df)
+{
+    hdr->disp_x = ff->disp_x;
+    hdr->disp_y = ff->disp_y;
+    hdr->disp_w = ff->disp_w;
+    hdr->disp_h = ff->disp_h;
+    hdr->seq    = 0;
+    hdr->ack    = 0;
+    reaped      = 0;
+    dropped     = 0;
+
+    hdr->version = OFBP_SHM_VERSION;
+    __sync_synchronize();
+    hdr->magic   = OFBP_SHM_MAGIC;
+
+    reap_stop = 0;
+    if (pthread_create(&reap_thread, NULL, shm_reaper, NULL)) {
+        fprintf(stderr, "shm: error starting reaper thread\n");
+        return -1;
+    }
+    reap_running = 1;
+
+    return 0;
+}
+
+static void
+shm_prepare(struct frame *f)
+{
+}
+
+static void
+shm_show(struct frame *f)
+{
+    uint32_t seq = hdr->seq + 1;
+    struct ofbp_shm_slot *s = &hdr->slots[seq % num_frames];
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    s->seq      = seq;
+    s->frame    = f->frame_num;
+    s->pts_sec  = ts.tv_sec;
+    s->pts_nsec = ts.tv_nsec;
+
+    __sync_synchronize();
+    hdr->seq = seq;
+
+    futex(&hdr->seq, FUTEX_WAKE, INT32_MAX, NULL);
+}
+
+static void
+shm_close(void)
+{
+    close(shm_fd);
+    shm_fd = -1;
+    shm_unlink(shm_name);
+}
+
+static const struct memman shm_mem = {
+    .name         = "shm",
+    .flags        = OFBP_FD_MEM,
+    .alloc_frames = shm_alloc_frames,
+    .free_frames  = shm_free_frames,
+};
+
+DISPLAY(shm) = {
+    .name    = "shm",
+    .flags   = OFBP_PRIV_MEM,
+    .open    = shm_open_disp,
+    .enable  = shm_enable,
+    .prepare = shm_prepare,
+    .show    = shm_show,
+    .close   = shm_close,
+    .memman  = &shm_mem,
+};
@@ -28,22 +28,30 @@
 
 #include "frame.h"
 #include "memman.h"
+#include "pixfmt.h"
 #include "util.h"
 
 static uint8_t *frame_buf;
 
-static int
-sysmem_alloc_frames(struct frame_format *ff, unsigned bufsize,
-                    struct frame **fr, unsigned *nf)
+int
+ofbp_sysmem_alloc(struct frame_format *ff, unsigned bufsize,
+                  struct frame **fr, unsigned *nf)
 {
-    int buf_w = ff->width, buf_h = ff->height;
+    const struct pixfmt *pf = ofbp_get_pixfmt(ff->pixfmt);
     struct frame *frames;
     unsigned num_frames;
     unsigned frame_size;
+    int offs[3], stride[3];
     void *fbp;
-    int i;
+    int i, j;
 
-    frame_size = buf_w * buf_h * 3 / 2;
+    if (!pf) {
+        fprintf(stderr, "Unsupported pixel format %d\n", ff->pixfmt);
+        return -1;
+    }
+
+    frame_size = ofbp_get_plane_layout(offs, stride, pf,
+                                       ff->width, ff->height);
     num_frames = MAX(bufsize / frame_size, MIN_FRAMES);
     bufsize = num_frames * frame_size;
 
@@ -62,16 +70,15 @@ sysmem_alloc_frames(struct frame_format *ff, unsigned bufsize,
         uint8_t *p = frame_buf + i * frame_size;
 
         frames[i].ff = ff;
-        frames[i].virt[0] = p;
-        frames[i].virt[1] = p + buf_w * buf_h;
-        frames[i].virt[2] = frames[i].virt[1] + buf_w / 2;
-        frames[i].linesize[0] = ff->width;
-        frames[i].linesize[1] = ff->width;
-        frames[i].linesize[2] = ff->width;
+        frames[i].fd = -1;
+        for (j = 0; j < 3; j++) {
+            frames[i].virt[j]     = p + offs[j];
+            frames[i].linesize[j] = stride[j];
+        }
     }
 
-    ff->y_stride  = ff->width;
-    ff->uv_stride = ff->width;
+    ff->y_stride  = stride[0];
+    ff->uv_stride = stride[1];
 
     *fr = frames;
     *nf = num_frames;
@@ -79,15 +86,16 @@ sysmem_alloc_frames(struct frame_format *ff, unsigned bufsize,
     return 0;
 }
 
-static void
-sysmem_free_frames(struct frame *frames, unsigned nf)
+void
+ofbp_sysmem_free(struct frame *frames, unsigned nf)
 {
     free(frame_buf);
     frame_buf = NULL;
+    free(frames);
 }
 
 DRIVER(memman, sysmem) = {
     .name         = "system",
-    .alloc_frames = sysmem_alloc_frames,
-    .free_frames  = sysmem_free_frames,
+    .alloc_frames = ofbp_sysmem_alloc,
+    .free_frames  = ofbp_sysmem_free,
 };
@@ -0,0 +1,336 @@
+/*
+    Copyright (C) 2011 Mans Rullgard
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+    HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "display.h"
+#include "memman.h"
+#include "util.h"
+
+#define MAX_CHILDREN 4
+#define QUEUE_SIZE   64
+
+static struct tee_child {
+    const struct display *disp;
+    struct frame_format df;
+    struct frame *queue[QUEUE_SIZE];
+    unsigned head;
+    unsigned count;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int running;
+    int stop;
+} children[MAX_CHILDREN];
+
+static unsigned num_children;
+static char *tee_args;
+
+static const struct display *
+find_display(const char *name, const char **param)
+{
+    const struct display **d;
+    const char *p = strchr(name, ':');
+    int len = p? p - name: strlen(name);
+
+    *param = p? p + 1: NULL;
+
+    for (d = ofbp_display_start; *d; d++)
+        if (!strncmp((*d)->name, name, len) && !(*d)->name[len])
+            return *d;
+
+    return NULL;
+}
+
+static void *
+tee_thread(void *p)
+{
+    struct tee_child *c = p;
+
+    pthread_mutex_lock(&c->lock);
+
+    for (;;) {
+        struct frame *f;
+
+        while (!c->count && !c->stop)
+            pthread_cond_wait(&c->cond, &c->lock);
+
+        if (!c->count)
+            break;
+
+        f = c->queue[c->head];
+        c->head = (c->head + 1) % QUEUE_SIZE;
+        c->count--;
+        pthread_cond_signal(&c->cond);
+        pthread_mutex_unlock(&c->lock);
+
+        c->disp->prepare(f);
+        c->disp->show(f);
+
+        pthread_mutex_lock(&c->lock);
+    }
+
+    pthread_mutex_unlock(&c->lock);
+
+    return NULL;
+}
+
+static void
+tee_flush(void)
+{
+    int i;
+
+    for (i = 1; i < num_children; i++) {
+        struct tee_child *c = &children[i];
+
+        if (!c->running)
+            continue;
+
+        pthread_mutex_lock(&c->lock);
+        c->stop = 1;
+        pthread_cond_broadcast(&c->cond);
+        pthread_mutex_unlock(&c->lock);
+
+        pthread_join(c->thread, NULL);
+        c->running = 0;
+    }
+
+    for (i = 0; i < num_children; i++)
+        if (children[i].disp->flush)
+            children[i].disp->flush();
+}
+
+static void
+tee_close(void)
+{
+    int i;
+
+    tee_flush();
+
+    for (i = 0; i < num_children; i++) {
+        children[i].disp->close();
+        pthread_mutex_destroy(&children[i].lock);
+        pthread_cond_destroy(&children[i].cond);
+    }
+
+    num_children = 0;
+
+    free(tee_args);
+    tee_args = NULL;
+}
+
+static int
+tee_open(const char *arg, struct frame_format *dp, struct frame_format *ff)
+{
+    char *name, *next;
+    int i;
+
+    if (!arg)
+        goto argerr;
+
+    tee_args = strdup(arg);
+    if (!tee_args)
+        return -1;
+
+    for (name = tee_args; name; name = next) {
+        struct tee_child *c = &children[num_children];
+        const char *param;
+
+        next = strchr(name, '+');
+        if (next)
+            *next++ = 0;
+
+        if (num_children == MAX_CHILDREN) {
+            fprintf(stderr, "tee: too many displays\n");
+            goto err;
+        }
+
+        c->disp = find_display(name, &param);
+        if (!c->disp || !strcmp(c->disp->name, "tee")) {
+            fprintf(stderr, "tee: display '%s' not found\n", name);
+            goto err;
+        }
+
+        for (i = 0; i < num_children; i++) {
+            if (children[i].disp == c->disp) {
+                fprintf(stderr, "tee: %s used more than once\n",
+                        c->disp->name);
+                goto err;
+            }
+        }
+
+        if (num_children && !(c->disp->flags & OFBP_ANY_MEM)) {
+            fprintf(stderr, "tee: %s can only be the first display\n",
+                    c->disp->name);
+            goto err;
+        }
+
+        c->df = *dp;
+        if (c->disp->open(param, num_children? &c->df: dp, ff)) {
+            fprintf(stderr, "tee: error opening %s\n", c->disp->name);
+            goto err;
+        }
+
+        /*
+         * Frames come from the primary's memman.  Unless the player
+         * converts into the primary with a pixconv, which it only does
+         * when the formats differ, there is nothing to allocate from.
+         */
+        if (!num_children && !c->disp->memman && dp->pixfmt == ff->pixfmt) {
+            fprintf(stderr, "tee: %s has no frame memory of its own "
+                    "and cannot be the first display\n", c->disp->name);
+            c->disp->close();
+            goto err;
+        }
+
+        pthread_mutex_init(&c->lock, NULL);
+        pthread_cond_init(&c->cond, NULL);
+        c->head    = 0;
+        c->count   = 0;
+        c->running = 0;
+        c->stop    = 0;
+
+        num_children++;
+    }
+
+    return 0;
+
+argerr:
+    fprintf(stderr, "tee: params: display[:params]+display[:params]...\n");
+    return -1;
+err:
+    tee_close();
+    return -1;
+}
+
+static int
+tee_enable(struct frame_format *ff, unsigned flags,
+           const struct pixconv *pc, struct frame_format *df)
+{
+    const struct display *primary = children[0].disp;
+    int i;
+
+    if (pc && (primary->flags & OFBP_PRIV_MEM)) {
+        fprintf(stderr, "Decoder/display pixel format mismatch\n");
+        return -1;
+    }
+
+    if (primary->enable(ff, flags, pc, df))
+        return -1;
+
+    for (i = 1; i < num_children; i++) {
+        struct tee_child *c = &children[i];
+
+        c->df.disp_x = 0;
+        c->df.disp_y = 0;
+        c->df.disp_w = ff->disp_w;
+        c->df.disp_h = ff->disp_h;
+
+        if (c->disp->enable(ff, flags & ~OFBP_FULLSCREEN, NULL, &c->df))
+            return -1;
+
+        if (pthread_create(&c->thread, NULL, tee_thread, c)) {
+            fprintf(stderr, "tee: error starting thread\n");
+            return -1;
+        }
+
+        c->running = 1;
+    }
+
+    return 0;
+}
+
+static void
+tee_prepare(struct frame *f)
+{
+    children[0].disp->prepare(f);
+}
+
+static void
+tee_show(struct frame *f)
+{
+    int i;
+
+    for (i = 1; i < num_children; i++) {
+        struct tee_child *c = &children[i];
+
+        ofbp_ref_frame(f);
+
+        pthread_mutex_lock(&c->lock);
+        while (c->count == QUEUE_SIZE)
+            pthread_cond_wait(&c->cond, &c->lock);
+        c->queue[(c->head + c->count++) % QUEUE_SIZE] = f;
+        pthread_cond_broadcast(&c->cond);
+        pthread_mutex_unlock(&c->lock);
+    }
+
+    children[0].disp->show(f);
+}
+
+static int
+tee_feedback(struct timespec *flip, unsigned *period)
+{
+    const struct display *primary = children[0].disp;
+
+    if (!primary->feedback)
+        return -1;
+
+    return primary->feedback(flip, period);
+}
+
+static int
+tee_alloc_frames(struct frame_format *ff, unsigned bufsize,
+                 struct frame **fr, unsigned *nf)
+{
+    return children[0].disp->memman->alloc_frames(ff, bufsize, fr, nf);
+}
+
+static void
+tee_free_frames(struct frame *frames, unsigned nf)
+{
+    children[0].disp->memman->free_frames(frames, nf);
+}
+
+static const struct memman tee_mem = {
+    .name         = "tee",
+    .alloc_frames = tee_alloc_frames,
+    .free_frames  = tee_free_frames,
+};
+
+DISPLAY(tee) = {
+    .name    = "tee",
+    .flags   = OFBP_FULLSCREEN | OFBP_DOUBLE_BUF,
+    .open    = tee_open,
+    .enable  = tee_enable,
+    .prepare = tee_prepare,
+    .show    = tee_show,
+    .flush   = tee_flush,
+    .feedback = tee_feedback,
+    .close   = tee_close,
+    .memman  = &tee_mem,
+};
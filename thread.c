@@ -0,0 +1,262 @@
+/*
+    Copyright (C) 2011 Mans Rullgard
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+    HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "thread.h"
+#include "util.h"
+
+struct thread_conf {
+    const char *name;
+    int policy;
+    int prio;
+    int set_cpus;
+    cpu_set_t cpus;
+};
+
+static struct thread_conf thread_conf[OFBP_THREAD_NUM] = {
+    [OFBP_THREAD_DISPLAY] = { "display", -1 },
+    [OFBP_THREAD_DECODE]  = { "decode",  -1 },
+    [OFBP_THREAD_DEMUX]   = { "demux",   -1 },
+    [OFBP_THREAD_NETSYNC] = { "netsync", -1 },
+};
+
+static const struct {
+    const char *name;
+    int policy;
+} policies[] = {
+    { "other", SCHED_OTHER },
+    { "fifo",  SCHED_FIFO  },
+    { "rr",    SCHED_RR    },
+#ifdef SCHED_BATCH
+    { "batch", SCHED_BATCH },
+#endif
+#ifdef SCHED_IDLE
+    { "idle",  SCHED_IDLE  },
+#endif
+};
+
+static int thread_report;
+
+static const char *
+policy_name(int policy)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(policies); i++)
+        if (policies[i].policy == policy)
+            return policies[i].name;
+
+    return "unknown";
+}
+
+static int
+parse_cpus(const char *p, cpu_set_t *cpus)
+{
+    CPU_ZERO(cpus);
+
+    while (*p) {
+        char *end;
+        int first = strtol(p, &end, 10);
+        int last = first;
+
+        if (end == p)
+            return -1;
+
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first)
+                return -1;
+        }
+
+        if (last >= CPU_SETSIZE)
+            return -1;
+
+        while (first <= last)
+            CPU_SET(first++, cpus);
+
+        p = end + (*end == ',');
+        if (*end && *end != ',')
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Parse thread=[policy][:priority][@cpus], e.g. display=fifo:80@1
+ * or demux=@0,2-3.
+ */
+int
+ofbp_thread_opt(const char *spec)
+{
+    struct thread_conf *tc = NULL;
+    const char *p;
+    int min, max;
+    int len;
+    int i;
+
+    len = strcspn(spec, "=");
+    if (!spec[len])
+        goto err;
+
+    for (i = 0; i < OFBP_THREAD_NUM; i++)
+        if (!strncmp(thread_conf[i].name, spec, len) &&
+            !thread_conf[i].name[len])
+            tc = &thread_conf[i];
+
+    if (!tc)
+        goto err;
+
+    p = spec + len + 1;
+    len = strcspn(p, ":@");
+
+    if (len) {
+        for (i = 0; i < ARRAY_SIZE(policies); i++)
+            if (!strncmp(policies[i].name, p, len) && !policies[i].name[len])
+                break;
+        if (i == ARRAY_SIZE(policies))
+            goto err;
+        tc->policy = policies[i].policy;
+        /* fifo and rr need a priority of at least 1 */
+        tc->prio   = sched_get_priority_min(tc->policy);
+    }
+
+    p += len;
+
+    if (*p == ':') {
+        char *end;
+        tc->prio = strtol(p + 1, &end, 0);
+        if (end == p + 1)
+            goto err;
+        if (tc->policy == -1)
+            tc->policy = SCHED_FIFO;
+        p = end;
+    }
+
+    if (*p == '@') {
+        if (parse_cpus(p + 1, &tc->cpus))
+            goto err;
+        tc->set_cpus = 1;
+    } else if (*p) {
+        goto err;
+    }
+
+    if (tc->policy != -1) {
+        min = sched_get_priority_min(tc->policy);
+        max = sched_get_priority_max(tc->policy);
+
+        if (tc->prio < min || tc->prio > max) {
+            fprintf(stderr, "%s thread: priority %d out of range %d-%d "
+                    "for %s\n", tc->name, tc->prio, min, max,
+                    policy_name(tc->policy));
+            return -1;
+        }
+    }
+
+    thread_report = 1;
+
+    return 0;
+
+err:
+    fprintf(stderr, "Bad thread option '%s', expected "
+            "display|decode|demux|netsync=[policy][:prio][@cpus]\n", spec);
+    return -1;
+}
+
+static void
+format_cpus(char *buf, int size, const cpu_set_t *cpus)
+{
+    int len = 0;
+    int i, j;
+
+    buf[0] = 0;
+
+    for (i = 0; i < CPU_SETSIZE && len < size; i = j) {
+        if (!CPU_ISSET(i, cpus)) {
+            j = i + 1;
+            continue;
+        }
+
+        for (j = i + 1; j < CPU_SETSIZE && CPU_ISSET(j, cpus); j++)
+            ;
+
+        if (j - i > 1)
+            len += snprintf(buf + len, size - len, "%s%d-%d",
+                            len? ",": "", i, j - 1);
+        else
+            len += snprintf(buf + len, size - len, "%s%d", len? ",": "", i);
+    }
+}
+
+/*
+ * Apply the configured policy and affinity to the calling thread and,
+ * if any were requested, report what it ended up with.
+ */
+void
+ofbp_thread_setup(int thread)
+{
+    struct thread_conf *tc = &thread_conf[thread];
+    pthread_t self = pthread_self();
+    struct sched_param sp;
+    cpu_set_t cpus;
+    char cpu_str[64];
+    int policy;
+    int err;
+
+    if (tc->policy != -1) {
+        sp.sched_priority = tc->prio;
+        err = pthread_setschedparam(self, tc->policy, &sp);
+        if (err)
+            fprintf(stderr, "%s thread: %s priority %d: %s\n", tc->name,
+                    policy_name(tc->policy), tc->prio, strerror(err));
+    }
+
+    if (tc->set_cpus) {
+        err = pthread_setaffinity_np(self, sizeof(tc->cpus), &tc->cpus);
+        if (err)
+            fprintf(stderr, "%s thread: affinity: %s\n", tc->name,
+                    strerror(err));
+    }
+
+    if (!thread_report)
+        return;
+
+    if (pthread_getschedparam(self, &policy, &sp))
+        return;
+
+    if (pthread_getaffinity_np(self, sizeof(cpus), &cpus))
+        strcpy(cpu_str, "?");
+    else
+        format_cpus(cpu_str, sizeof(cpu_str), &cpus);
+
+    fprintf(stderr, "%s thread: %s priority %d, cpus %s\n", tc->name,
+            policy_name(policy), sp.sched_priority, cpu_str);
+}
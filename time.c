@@ -39,6 +39,13 @@ ts_diff_ns(const struct timespec *ts1, const struct timespec *ts2)
         ts1->tv_nsec - ts2->tv_nsec;
 }
 
+long long
+ts_sdiff_ns(const struct timespec *ts1, const struct timespec *ts2)
+{
+    return (long long)(ts1->tv_sec - ts2->tv_sec) * 1000000000 +
+        ts1->tv_nsec - ts2->tv_nsec;
+}
+
 void
 ts_add_ns(struct timespec *ts, unsigned nsec)
 {
@@ -49,6 +56,20 @@ ts_add_ns(struct timespec *ts, unsigned nsec)
     }
 }
 
+void
+ts_add_sns(struct timespec *ts, long long nsec)
+{
+    ts->tv_sec  += nsec / 1000000000;
+    ts->tv_nsec += nsec % 1000000000;
+    if (ts->tv_nsec < 0) {
+        ts->tv_sec--;
+        ts->tv_nsec += 1000000000;
+    } else if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
 void
 ts_add(struct timespec *ts, const struct timespec *td)
 {
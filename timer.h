@@ -33,8 +33,13 @@ struct timer {
     const char *name;
     int (*open)(const char *);
     int (*start)(struct timespec *ts);
+    int (*epoch)(struct timespec *ts);  /* start of a show already running */
     int (*read)(struct timespec *ts);
     int (*wait)(struct timespec *ts);
+    int (*wait_fd)(const struct timespec *ts);  /* pollable fd for ts */
+    void (*shown)(unsigned frame, const struct timespec *ts);
+    int (*master_pos)(unsigned *frame, struct timespec *ts);
+    int (*advance)(unsigned nsec);
     int (*close)(void);
 };
 
@@ -42,9 +47,14 @@ extern const struct timer *ofbp_timer_start[];
 
 #define TIMER(name) DRIVER(timer, name)
 
+int ofbp_timer_advance(unsigned nsec);
+int ofbp_timer_read(struct timespec *ts);
+
 unsigned ts_diff_ms(struct timespec *tv1, struct timespec *tv2);
 unsigned ts_diff_ns(const struct timespec *ts1, const struct timespec *ts2);
+long long ts_sdiff_ns(const struct timespec *ts1, const struct timespec *ts2);
 void ts_add_ns(struct timespec *ts, unsigned nsec);
+void ts_add_sns(struct timespec *ts, long long nsec);
 void ts_add(struct timespec *ts, const struct timespec *td);
 void ts_sub(struct timespec *ts, const struct timespec *td);
 
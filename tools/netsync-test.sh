@@ -0,0 +1,166 @@
+#!/bin/sh
+#
+# Measure netsync accuracy on one host.
+#
+# Starts a master and N slaves on the null display, each writing a
+# presentation log (-L), and reports percentiles of how far each slave
+# showed every frame from the master.  All processes share
+# CLOCK_MONOTONIC, so the logs can be compared directly.  Frames are
+# matched on their number, which relies on every node starting with the
+# master's GO.
+#
+# By default everything talks over loopback.  With -d or -j, each slave
+# runs in its own network namespace, linked to the host by a veth pair
+# with netem delay and jitter on both ends; this needs root and the ip
+# and tc tools.
+#
+# Usage: netsync-test.sh [options] clip
+#   -n slaves     number of slaves (2)
+#   -t seconds    how long to play (20)
+#   -p port       netsync port (5000)
+#   -d delay      netem delay each way, e.g. 2ms
+#   -j jitter     netem jitter, e.g. 500us
+#   -o dir        keep logs here instead of a temporary directory
+#   -b binary     omapfbplay to run (./omapfbplay)
+#   -T params     extra netsync parameters, e.g. k=none
+#
+
+slaves=2
+secs=20
+port=5000
+delay=
+jitter=
+dir=
+bin=./omapfbplay
+extra=
+
+usage() {
+    sed -n '/^# Usage/,/^#$/s/^# \{0,1\}//p' "$0" >&2
+    exit 1
+}
+
+while getopts n:t:p:d:j:o:b:T: opt; do
+    case $opt in
+    n) slaves=$OPTARG ;;
+    t) secs=$OPTARG ;;
+    p) port=$OPTARG ;;
+    d) delay=$OPTARG ;;
+    j) jitter=$OPTARG ;;
+    o) dir=$OPTARG ;;
+    b) bin=$OPTARG ;;
+    T) extra=,$OPTARG ;;
+    *) usage ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+[ $# -eq 1 ] || usage
+clip=$1
+
+if [ -n "$dir" ]; then
+    mkdir -p "$dir" || exit 1
+    keep=1
+else
+    dir=$(mktemp -d) || exit 1
+    keep=
+fi
+
+netns=
+[ -n "$delay$jitter" ] && netns=1
+
+pids=
+
+cleanup() {
+    for p in $pids; do
+        kill $p 2>/dev/null
+    done
+    wait 2>/dev/null
+
+    if [ -n "$netns" ]; then
+        i=1
+        while [ $i -le $slaves ]; do
+            ip link del ofbp$i 2>/dev/null
+            ip netns del ofbp$i 2>/dev/null
+            i=$((i + 1))
+        done
+    fi
+
+    [ -n "$keep" ] || rm -rf "$dir"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+# link slave $1 to the host, 10.77.$1.1 on the host, .2 in the namespace
+setup_ns() {
+    ns=ofbp$1
+    netem="netem delay ${delay:-0ms} $jitter"
+
+    ip netns add $ns &&
+    ip link add $ns type veth peer name eth0 netns $ns &&
+    ip addr add 10.77.$1.1/24 dev $ns &&
+    ip link set $ns up &&
+    ip -n $ns addr add 10.77.$1.2/24 dev eth0 &&
+    ip -n $ns link set eth0 up &&
+    ip -n $ns link set lo up &&
+    tc qdisc add dev $ns root $netem &&
+    tc -n $ns qdisc add dev eth0 root $netem
+}
+
+"$bin" -T netsync:s=$slaves,p=$port$extra -d null -L "$dir/master.log" \
+    "$clip" >"$dir/master.err" 2>&1 &
+pids="$pids $!"
+
+i=1
+while [ $i -le $slaves ]; do
+    if [ -n "$netns" ]; then
+        setup_ns $i || exit 1
+        ip netns exec ofbp$i "$bin" -T netsync:m=10.77.$i.1:$port$extra \
+            -d null -L "$dir/slave$i.log" "$clip" >"$dir/slave$i.err" 2>&1 &
+    else
+        "$bin" -T netsync:m=127.0.0.1:$port$extra \
+            -d null -L "$dir/slave$i.log" "$clip" >"$dir/slave$i.err" 2>&1 &
+    fi
+    pids="$pids $!"
+    i=$((i + 1))
+done
+
+sleep $secs
+
+for p in $pids; do
+    kill -INT $p 2>/dev/null
+done
+wait 2>/dev/null
+pids=
+
+[ -s "$dir/master.log" ] || { echo "no frames from the master" >&2; exit 1; }
+
+# per-slave percentiles of the error, then all slaves together, in us
+report() {
+    sort -n | awk -v name="$1" '
+        { e[NR] = $1; a = $1 < 0? -$1: $1; if (a > max) max = a }
+        function p(q) { return e[int((NR - 1) * q / 100) + 1] }
+        END {
+            if (!NR) { printf "%-8s no frames matched\n", name; exit }
+            printf "%-8s %6d %8.1f %8.1f %8.1f %8.1f %8.1f %9.1f\n",
+                name, NR, p(1), p(10), p(50), p(90), p(99), max
+        }'
+}
+
+printf "%-8s %6s %8s %8s %8s %8s %8s %9s\n" \
+    node frames p1_us p10_us p50_us p90_us p99_us absmax_us
+
+i=1
+while [ $i -le $slaves ]; do
+    awk 'NR == FNR { t[$1] = $2; next }
+         $1 in t {
+             split(t[$1], m, "."); split($2, s, ".")
+             printf "%.3f\n", ((s[1] - m[1]) * 1e9 + s[2] - m[2]) / 1000
+         }' "$dir/master.log" "$dir/slave$i.log" |
+        tee "$dir/slave$i.err_us" | report slave$i
+    i=$((i + 1))
+done
+
+cat "$dir"/slave*.err_us | report all
+
+[ -n "$keep" ] && echo "logs in $dir"
+exit 0
@@ -42,5 +42,7 @@
 #define OFBP_DOUBLE_BUF 2
 #define OFBP_PHYS_MEM   4
 #define OFBP_PRIV_MEM   8
+#define OFBP_FD_MEM     16
+#define OFBP_ANY_MEM    32
 
 #endif /* OFBP_UTIL_H */
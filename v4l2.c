@@ -28,6 +28,7 @@
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <time.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 
@@ -77,6 +78,8 @@ static struct frame *vid_frames;
 static struct vid_buffer *vid_buffers;
 static struct vid_buffer *cur_buf;
 static int num_buffers;
+static struct timespec flip_time;
+static unsigned vbl_period;
 
 #define xioctl(fd, req, param) do {             \
         if (ioctl(fd, req, param) == -1) {      \
@@ -209,6 +212,11 @@ static int get_fbsize(struct frame_format *df)
     if (!err) {
         df->width  = sinfo.xres;
         df->height = sinfo.yres;
+        vbl_period = (unsigned long long)sinfo.pixclock *
+            (sinfo.xres + sinfo.left_margin +
+             sinfo.right_margin + sinfo.hsync_len) *
+            (sinfo.yres + sinfo.upper_margin +
+             sinfo.lower_margin + sinfo.vsync_len) / 1000;
     }
 
     close(fd);
@@ -334,9 +342,37 @@ err:
 
 static int dqbuf(struct v4l2_buffer *buf)
 {
+    int err;
+
     buf->type   = V4L2_BUF_TYPE_VIDEO_OUTPUT;
     buf->memory = V4L2_MEMORY_MMAP;
-    return ioctl(vid_fd, VIDIOC_DQBUF, buf);
+    err = ioctl(vid_fd, VIDIOC_DQBUF, buf);
+
+    /* a buffer is released when its successor goes on screen */
+    if (!err) {
+#ifdef V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC
+        if ((buf->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) ==
+            V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC &&
+            buf->timestamp.tv_sec) {
+            flip_time.tv_sec  = buf->timestamp.tv_sec;
+            flip_time.tv_nsec = buf->timestamp.tv_usec * 1000;
+        } else
+#endif
+            clock_gettime(CLOCK_MONOTONIC, &flip_time);
+    }
+
+    return err;
+}
+
+static int v4l2_feedback(struct timespec *flip, unsigned *period)
+{
+    if (!flip_time.tv_sec)
+        return -1;
+
+    *flip   = flip_time;
+    *period = vbl_period;
+
+    return 0;
 }
 
 static void v4l2_prepare(struct frame *f)
@@ -413,6 +449,7 @@ static int v4l2_alloc(struct frame_format *ff, unsigned max_mem,
 
     for (i = 0; i < nframes; i++) {
         frames[i].ff = ff;
+        frames[i].fd = -1;
         for (j = 0; j < 3; j++) {
             frames[i].virt[j]     = vb[i].data[j];
             frames[i].linesize[j] = stride[j];
@@ -450,6 +487,7 @@ DISPLAY(v4l2) = {
     .enable  = v4l2_enable,
     .prepare = v4l2_prepare,
     .show    = v4l2_show,
+    .feedback = v4l2_feedback,
     .close   = v4l2_close,
     .memman  = &v4l2_memman,
 };
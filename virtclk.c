@@ -0,0 +1,97 @@
+/*
+    Copyright (C) 2011 Mans Rullgard
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+    HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+ */
+
+#include <time.h>
+#include <pthread.h>
+
+#include "timer.h"
+
+/*
+ * Virtual time: wait() jumps straight to the deadline and read()
+ * returns the current virtual time, so playback runs as fast as frames
+ * can be decoded while scheduling decisions stay those of a real-time
+ * run.  Displays may charge simulated work with ofbp_timer_advance().
+ */
+
+static pthread_mutex_t vt_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct timespec vt_now;
+
+static int
+virtclk_open(const char *arg)
+{
+    clock_gettime(CLOCK_MONOTONIC, &vt_now);
+    vt_now.tv_nsec = 0;
+    return 0;
+}
+
+static int
+virtclk_read(struct timespec *ts)
+{
+    pthread_mutex_lock(&vt_lock);
+    *ts = vt_now;
+    pthread_mutex_unlock(&vt_lock);
+    return 0;
+}
+
+static int
+virtclk_start(struct timespec *ts)
+{
+    return virtclk_read(ts);
+}
+
+static int
+virtclk_wait(struct timespec *ts)
+{
+    pthread_mutex_lock(&vt_lock);
+    if (ts->tv_sec > vt_now.tv_sec ||
+        (ts->tv_sec == vt_now.tv_sec && ts->tv_nsec > vt_now.tv_nsec))
+        vt_now = *ts;
+    pthread_mutex_unlock(&vt_lock);
+    return 0;
+}
+
+static int
+virtclk_advance(unsigned nsec)
+{
+    pthread_mutex_lock(&vt_lock);
+    ts_add_ns(&vt_now, nsec);
+    pthread_mutex_unlock(&vt_lock);
+    return 0;
+}
+
+static int
+virtclk_close(void)
+{
+    return 0;
+}
+
+TIMER(virtclk) = {
+    .name    = "virtual",
+    .open    = virtclk_open,
+    .start   = virtclk_start,
+    .read    = virtclk_read,
+    .wait    = virtclk_wait,
+    .advance = virtclk_advance,
+    .close   = virtclk_close,
+};
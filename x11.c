@@ -0,0 +1,330 @@
+/*
+    Copyright (C) 2011 Mans Rullgard
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+    HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/shm.h>
+#include <sys/ipc.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+
+#include "display.h"
+#include "pixconv.h"
+#include "x11.h"
+#include "util.h"
+
+#define NUM_IMAGES 3
+
+static Display *dpy;
+static Window win;
+static GC gc;
+static int shm_completion;
+static const struct pixconv *pixconv;
+static unsigned img_w, img_h;
+static unsigned out_x, out_y;
+static int cur_image;
+
+static struct {
+    XImage *xim;
+    XShmSegmentInfo xshm;
+    int busy;
+} images[NUM_IMAGES];
+
+void
+ofbp_x11_fullscreen(Display *dpy, Window win)
+{
+    Atom supporting;
+    int netwm = 0;
+
+    supporting = XInternAtom(dpy, "_NET_SUPPORTING_WM_CHECK", True);
+
+    if (supporting != None) {
+        Atom xa_window = XInternAtom(dpy, "WINDOW", True);
+        unsigned long count, bytes_remain;
+        unsigned char *p = NULL, *p2 = NULL;
+        int r, r_format;
+        Atom r_type;
+
+        r = XGetWindowProperty(dpy, DefaultRootWindow(dpy),
+                               supporting, 0, 1, False, xa_window,
+                               &r_type, &r_format, &count, &bytes_remain, &p);
+
+        if (r == Success && p && r_type == xa_window && r_format == 32 &&
+            count == 1) {
+            Window w = *(Window *)p;
+
+            r = XGetWindowProperty(dpy, w, supporting, 0, 1,
+                                   False, xa_window, &r_type, &r_format,
+                                   &count, &bytes_remain, &p2);
+
+            if(r == Success && p2 && *p2 == *p && r_type == xa_window &&
+               r_format == 32 && count == 1){
+                netwm = 1;
+            }
+        }
+
+        if (p)  XFree(p);
+        if (p2) XFree(p2);
+    }
+
+    if (netwm) {
+        Atom wm_state = XInternAtom(dpy, "_NET_WM_STATE", False);
+        Atom wm_fs = XInternAtom(dpy, "_NET_WM_STATE_FULLSCREEN", False);
+        XEvent xev = {};
+
+        xev.type = ClientMessage;
+        xev.xclient.window = win;
+        xev.xclient.message_type = wm_state;
+        xev.xclient.format = 32;
+        xev.xclient.data.l[0] = 1;
+        xev.xclient.data.l[1] = wm_fs;
+        xev.xclient.data.l[2] = 0;
+
+        XSendEvent(dpy, RootWindow(dpy, DefaultScreen(dpy)),
+                   False, SubstructureNotifyMask, &xev);
+    }
+}
+
+int
+ofbp_x11_shm_attach(Display *dpy, XShmSegmentInfo *xshm, unsigned size)
+{
+    xshm->shmid = shmget(IPC_PRIVATE, size, IPC_CREAT | 0777);
+    if (xshm->shmid == -1) {
+        perror("shmget");
+        return -1;
+    }
+
+    xshm->shmaddr = shmat(xshm->shmid, 0, 0);
+    if (xshm->shmaddr == (char *)-1) {
+        perror("shmat");
+        shmctl(xshm->shmid, IPC_RMID, NULL);
+        xshm->shmaddr = NULL;
+        return -1;
+    }
+
+    xshm->readOnly = False;
+    XShmAttach(dpy, xshm);
+    shmctl(xshm->shmid, IPC_RMID, NULL);
+
+    return 0;
+}
+
+void
+ofbp_x11_shm_detach(Display *dpy, XShmSegmentInfo *xshm)
+{
+    XShmDetach(dpy, xshm);
+    shmdt(xshm->shmaddr);
+    xshm->shmaddr = NULL;
+}
+
+static void
+free_images(void)
+{
+    int i;
+
+    for (i = 0; i < NUM_IMAGES; i++) {
+        if (!images[i].xim)
+            continue;
+        ofbp_x11_shm_detach(dpy, &images[i].xshm);
+        images[i].xim->data = NULL;
+        XDestroyImage(images[i].xim);
+        images[i].xim = NULL;
+    }
+}
+
+static int x11_open(const char *name, struct frame_format *dp,
+                    struct frame_format *ff)
+{
+    XWindowAttributes attr;
+    Visual *vis;
+    int depth;
+    int i;
+
+    dpy = XOpenDisplay(name);
+    if (!dpy) {
+        fprintf(stderr, "X11: error opening display\n");
+        return -1;
+    }
+
+    if (!XShmQueryExtension(dpy)) {
+        fprintf(stderr, "X11: MIT-SHM extension not present\n");
+        goto err;
+    }
+
+    vis   = DefaultVisual(dpy, DefaultScreen(dpy));
+    depth = DefaultDepth(dpy, DefaultScreen(dpy));
+
+    if (depth < 24 || vis->red_mask != 0xff0000 ||
+        vis->green_mask != 0xff00 || vis->blue_mask != 0xff) {
+        fprintf(stderr, "X11: unsupported visual, depth %d\n", depth);
+        goto err;
+    }
+
+    img_w = ff->disp_w;
+    img_h = ff->disp_h;
+
+    for (i = 0; i < NUM_IMAGES; i++) {
+        XImage *xim = XShmCreateImage(dpy, vis, depth, ZPixmap, NULL,
+                                      &images[i].xshm, img_w, img_h);
+        if (!xim)
+            goto err;
+
+        if (xim->bits_per_pixel != 32) {
+            fprintf(stderr, "X11: unsupported pixel size %d\n",
+                    xim->bits_per_pixel);
+            XDestroyImage(xim);
+            goto err;
+        }
+
+        if (ofbp_x11_shm_attach(dpy, &images[i].xshm,
+                                xim->bytes_per_line * xim->height)) {
+            XDestroyImage(xim);
+            goto err;
+        }
+
+        xim->data = images[i].xshm.shmaddr;
+        images[i].xim  = xim;
+        images[i].busy = 0;
+    }
+
+    shm_completion = XShmGetEventBase(dpy) + ShmCompletion;
+
+    XGetWindowAttributes(dpy, RootWindow(dpy, DefaultScreen(dpy)), &attr);
+    dp->width     = attr.width;
+    dp->height    = attr.height;
+    dp->pixfmt    = PIX_FMT_RGB32;
+    dp->y_stride  = images[0].xim->bytes_per_line;
+    dp->uv_stride = 0;
+
+    fprintf(stderr, "X11: using %d MIT-SHM images\n", NUM_IMAGES);
+
+    return 0;
+
+err:
+    free_images();
+    XCloseDisplay(dpy);
+    dpy = NULL;
+    return -1;
+}
+
+static int x11_enable(struct frame_format *ff, unsigned flags,
+                      const struct pixconv *pc, struct frame_format *df)
+{
+    if (!pc)
+        return -1;
+
+    win = XCreateWindow(dpy, RootWindow(dpy, DefaultScreen(dpy)),
+                        0, 0, img_w, img_h, 0, CopyFromParent,
+                        InputOutput, CopyFromParent, 0, NULL);
+    XSelectInput(dpy, win, StructureNotifyMask);
+    XSetWindowBackground(dpy, win, 0);
+
+    gc = XCreateGC(dpy, win, 0, NULL);
+
+    out_x = 0;
+    out_y = 0;
+    cur_image = 0;
+    pixconv = pc;
+
+    XMapWindow(dpy, win);
+
+    if (flags & OFBP_FULLSCREEN)
+        ofbp_x11_fullscreen(dpy, win);
+
+    return 0;
+}
+
+static void handle_event(XEvent *xe)
+{
+    int i;
+
+    if (xe->type == shm_completion) {
+        XShmCompletionEvent *sce = (XShmCompletionEvent *)xe;
+        for (i = 0; i < NUM_IMAGES; i++)
+            if (images[i].xshm.shmseg == sce->shmseg)
+                images[i].busy = 0;
+    } else if (xe->type == ConfigureNotify) {
+        XConfigureEvent *ce = &xe->xconfigure;
+        out_x = ce->width  > img_w? (ce->width  - img_w) / 2: 0;
+        out_y = ce->height > img_h? (ce->height - img_h) / 2: 0;
+        XClearWindow(dpy, win);
+    }
+}
+
+static void x11_prepare(struct frame *f)
+{
+    uint8_t *dst[3] = { NULL };
+    XEvent xe;
+
+    while (XPending(dpy)) {
+        XNextEvent(dpy, &xe);
+        handle_event(&xe);
+    }
+
+    while (images[cur_image].busy) {
+        XNextEvent(dpy, &xe);
+        handle_event(&xe);
+    }
+
+    dst[0] = (uint8_t *)images[cur_image].xim->data;
+    pixconv->convert(dst, f->vdata, NULL, f->pdata);
+}
+
+static void x11_show(struct frame *f)
+{
+    pixconv->finish();
+
+    XShmPutImage(dpy, win, gc, images[cur_image].xim, 0, 0,
+                 out_x, out_y, img_w, img_h, True);
+    XFlush(dpy);
+
+    images[cur_image].busy = 1;
+    cur_image = (cur_image + 1) % NUM_IMAGES;
+
+    ofbp_put_frame(f);
+}
+
+static void x11_close(void)
+{
+    XSync(dpy, False);
+    free_images();
+    XFreeGC(dpy, gc);
+    XDestroyWindow(dpy, win);
+    XCloseDisplay(dpy);
+    dpy = NULL;
+    pixconv = NULL;
+}
+
+DISPLAY(x11) = {
+    .name    = "x11",
+    .flags   = OFBP_FULLSCREEN,
+    .open    = x11_open,
+    .enable  = x11_enable,
+    .prepare = x11_prepare,
+    .show    = x11_show,
+    .close   = x11_close,
+};
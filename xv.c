@@ -27,8 +27,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <unistd.h>
-#include <sys/shm.h>
-#include <sys/ipc.h>
+#include <pthread.h>
 #include <X11/Xlib.h>
 #include <X11/extensions/XShm.h>
 #include <X11/extensions/Xvlib.h>
@@ -36,6 +35,8 @@
 #include "display.h"
 #include "util.h"
 #include "memman.h"
+#include "pixfmt.h"
+#include "x11.h"
 
 #define YV12 0x32315659
 
@@ -50,15 +51,29 @@ static struct {
     XShmSegmentInfo xshm;
 } *xv_frames;
 static unsigned out_x, out_y, out_w, out_h;
+static int shm_completion;
+
+static pthread_mutex_t xv_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t ev_thread;
+static int ev_running;
+static int ev_stop;
 
 static int
 xv_alloc_frames(struct frame_format *ff, unsigned bufsize,
                 struct frame **fr, unsigned *nf)
 {
+    const struct pixfmt *pf = ofbp_get_pixfmt(ff->pixfmt);
     unsigned frame_size;
+    int offs[3], stride[3];
     int i;
 
-    frame_size = ff->width * ff->height * 3 / 2;
+    if (ff->pixfmt != PIX_FMT_YUV420P) {
+        fprintf(stderr, "Xv: unsupported pixel format %d\n", ff->pixfmt);
+        return -1;
+    }
+
+    frame_size = ofbp_get_plane_layout(offs, stride, pf,
+                                       ff->width, ff->height);
     num_frames = MAX(bufsize / frame_size, MIN_FRAMES);
     bufsize = num_frames * frame_size;
 
@@ -75,17 +90,17 @@ xv_alloc_frames(struct frame_format *ff, unsigned bufsize,
         XvImage *xvi = XvShmCreateImage(dpy, xv_port, YV12, NULL,
                                         ff->width, ff->height, xshm);
 
-        xshm->shmid = shmget(IPC_PRIVATE, xvi->data_size, IPC_CREAT | 0777);
-        xshm->shmaddr = shmat(xshm->shmid, 0, 0);
-        xshm->readOnly = False;
-        XShmAttach(dpy, xshm);
-        shmctl(xshm->shmid, IPC_RMID, NULL);
+        if (ofbp_x11_shm_attach(dpy, xshm, xvi->data_size)) {
+            XFree(xvi);
+            goto err;
+        }
 
         xvi->data = xshm->shmaddr;
 
         xv_frames[i].xvi = xvi;
 
         frames[i].ff = ff;
+        frames[i].fd = -1;
         frames[i].virt[0] = xvi->data + xvi->offsets[0];
         frames[i].virt[1] = xvi->data + xvi->offsets[2];
         frames[i].virt[2] = xvi->data + xvi->offsets[1];
@@ -106,61 +121,6 @@ err:
     return -1;
 }
 
-static void
-set_fullscreen(void)
-{
-    Atom supporting;
-    int netwm = 0;
-
-    supporting = XInternAtom(dpy, "_NET_SUPPORTING_WM_CHECK", True);
-
-    if (supporting != None) {
-        Atom xa_window = XInternAtom(dpy, "WINDOW", True);
-        unsigned long count, bytes_remain;
-        unsigned char *p = NULL, *p2 = NULL;
-        int r, r_format;
-        Atom r_type;
-
-        r = XGetWindowProperty(dpy, DefaultRootWindow(dpy),
-                               supporting, 0, 1, False, xa_window,
-                               &r_type, &r_format, &count, &bytes_remain, &p);
-
-        if (r == Success && p && r_type == xa_window && r_format == 32 &&
-            count == 1) {
-            Window w = *(Window *)p;
-
-            r = XGetWindowProperty(dpy, w, supporting, 0, 1,
-                                   False, xa_window, &r_type, &r_format,
-                                   &count, &bytes_remain, &p2);
-
-            if(r == Success && p2 && *p2 == *p && r_type == xa_window &&
-               r_format == 32 && count == 1){
-                netwm = 1;
-            }
-        }
-
-        if (p)  XFree(p);
-        if (p2) XFree(p2);
-    }
-
-    if (netwm) {
-        Atom wm_state = XInternAtom(dpy, "_NET_WM_STATE", False);
-        Atom wm_fs = XInternAtom(dpy, "_NET_WM_STATE_FULLSCREEN", False);
-        XEvent xev = {};
-
-        xev.type = ClientMessage;
-        xev.xclient.window = win;
-        xev.xclient.message_type = wm_state;
-        xev.xclient.format = 32;
-        xev.xclient.data.l[0] = 1;
-        xev.xclient.data.l[1] = wm_fs;
-        xev.xclient.data.l[2] = 0;
-
-        XSendEvent(dpy, RootWindow(dpy, DefaultScreen(dpy)),
-                   False, SubstructureNotifyMask, &xev);
-    }
-}
-
 static int xv_open(const char *name, struct frame_format *dp,
                    struct frame_format *ff)
 {
@@ -170,6 +130,8 @@ static int xv_open(const char *name, struct frame_format *dp,
     XWindowAttributes attr;
     int i;
 
+    XInitThreads();
+
     dpy = XOpenDisplay(name);
     if (!dpy) {
         fprintf(stderr, "Xv: error opening display\n");
@@ -216,7 +178,7 @@ static int xv_open(const char *name, struct frame_format *dp,
     XvFreeAdaptorInfo(xai);
 
     if (!xv_port) {
-        fprintf(stderr, "Xv: no suitable port found\n");
+        fprintf(stderr, "Xv: no suitable port found, try -d x11\n");
         return -1;
     }
 
@@ -230,6 +192,36 @@ static int xv_open(const char *name, struct frame_format *dp,
     return 0;
 }
 
+static void *xv_event_thread(void *p)
+{
+    XEvent xe;
+    int i;
+
+    while (!ev_stop) {
+        XNextEvent(dpy, &xe);
+
+        if (xe.type == shm_completion) {
+            XShmCompletionEvent *sce = (XShmCompletionEvent *)&xe;
+            for (i = 0; i < num_frames; i++) {
+                if (xv_frames[i].xshm.shmseg == sce->shmseg) {
+                    ofbp_put_frame(&frames[i]);
+                    break;
+                }
+            }
+        } else if (xe.type == ConfigureNotify) {
+            pthread_mutex_lock(&xv_lock);
+            out_w = ffmt.disp_w;
+            out_h = ffmt.disp_h;
+            ofbp_scale(&out_x, &out_y, &out_w, &out_h,
+                       xe.xconfigure.width, xe.xconfigure.height);
+            pthread_mutex_unlock(&xv_lock);
+            XClearWindow(dpy, win);
+        }
+    }
+
+    return NULL;
+}
+
 static int xv_enable(struct frame_format *ff, unsigned flags,
                      const struct pixconv *pc, struct frame_format *df)
 {
@@ -246,48 +238,64 @@ static int xv_enable(struct frame_format *ff, unsigned flags,
     out_w = ff->disp_w;
     out_h = ff->disp_h;
 
+    shm_completion = XShmGetEventBase(dpy) + ShmCompletion;
+
     XMapWindow(dpy, win);
 
     if (flags & OFBP_FULLSCREEN)
-        set_fullscreen();
+        ofbp_x11_fullscreen(dpy, win);
+
+    XFlush(dpy);
+
+    ev_stop = 0;
+    if (pthread_create(&ev_thread, NULL, xv_event_thread, NULL)) {
+        fprintf(stderr, "Xv: error starting event thread\n");
+        return -1;
+    }
+    ev_running = 1;
 
     return 0;
 }
 
 static void xv_prepare(struct frame *f)
 {
-    XEvent xe, cn;
-
-    cn.type = 0;
-
-    while (XCheckMaskEvent(dpy, ~0, &xe))
-        if (xe.type == ConfigureNotify)
-            cn = xe;
-
-    if (cn.type) {
-        XWindowAttributes xwa;
-        XGetWindowAttributes(dpy, win, &xwa);
-        out_w = ffmt.disp_w;
-        out_h = ffmt.disp_h;
-        ofbp_scale(&out_x, &out_y, &out_w, &out_h, xwa.width, xwa.height);
-        XClearWindow(dpy, win);
-    }
 }
 
 static void xv_show(struct frame *f)
 {
     GC gc = DefaultGC(dpy, DefaultScreen(dpy));
 
+    pthread_mutex_lock(&xv_lock);
     XvShmPutImage(dpy, xv_port, win, gc, xv_frames[f->frame_num].xvi,
                   ffmt.disp_x, ffmt.disp_y, ffmt.disp_w, ffmt.disp_h,
-                  out_x, out_y, out_w, out_h, False);
+                  out_x, out_y, out_w, out_h, True);
+    pthread_mutex_unlock(&xv_lock);
+
+    XFlush(dpy);
+}
+
+static void xv_flush(void)
+{
+    XEvent xe = { 0 };
+
+    if (!ev_running)
+        return;
+
+    ev_stop = 1;
+
+    xe.type = ClientMessage;
+    xe.xclient.window = win;
+    xe.xclient.format = 32;
+    XSendEvent(dpy, win, False, 0, &xe);
+    XFlush(dpy);
 
-    XSync(dpy, False);
-    ofbp_put_frame(f);
+    pthread_join(ev_thread, NULL);
+    ev_running = 0;
 }
 
 static void xv_close(void)
 {
+    xv_flush();
     XvUngrabPort(dpy, xv_port, CurrentTime);
     XDestroyWindow(dpy, win);
     XCloseDisplay(dpy);
@@ -298,7 +306,7 @@ static void xv_free_frames(struct frame *frames, unsigned nf)
     int i;
 
     for (i = 0; i < num_frames; i++) {
-        XShmDetach(dpy, &xv_frames[i].xshm);
+        ofbp_x11_shm_detach(dpy, &xv_frames[i].xshm);
         XFree(xv_frames[i].xvi);
     }
 
@@ -319,6 +327,7 @@ DISPLAY(xv) = {
     .enable  = xv_enable,
     .prepare = xv_prepare,
     .show  = xv_show,
+    .flush = xv_flush,
     .close = xv_close,
     .memman = &xv_mem,
 };
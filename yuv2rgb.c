@@ -0,0 +1,99 @@
+/*
+    Copyright (C) 2011 Mans Rullgard
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+    HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdint.h>
+
+#include "pixconv.h"
+#include "pixfmt.h"
+#include "util.h"
+
+static unsigned width, height;
+static unsigned src_stride[3];
+static unsigned dst_stride;
+static int hsub, vsub;
+
+static inline unsigned clip8(int v)
+{
+    return v < 0? 0: v > 255? 255: v;
+}
+
+static int yuv2rgb_open(const struct frame_format *ffmt,
+                        const struct frame_format *dfmt)
+{
+    const struct pixfmt *p = ofbp_get_pixfmt(ffmt->pixfmt);
+
+    if (dfmt->pixfmt != PIX_FMT_RGB32)
+        return -1;
+
+    if (!p || p->bps != 1 || p->plane[1] != 1 || p->plane[2] != 2)
+        return -1;
+
+    width  = ffmt->disp_w;
+    height = ffmt->disp_h;
+    src_stride[0] = ffmt->y_stride;
+    src_stride[1] = ffmt->uv_stride;
+    src_stride[2] = ffmt->uv_stride;
+    dst_stride = dfmt->y_stride;
+    hsub = p->hsub[1];
+    vsub = p->vsub[1];
+
+    return 0;
+}
+
+/* ITU-R BT.601, limited range, 8-bit fixed point */
+
+static void yuv2rgb_convert(uint8_t *vdst[3], uint8_t *vsrc[3],
+                            uint8_t *pdst[3], uint8_t *psrc[3])
+{
+    int i, j;
+
+    for (i = 0; i < height; i++) {
+        const uint8_t *y = vsrc[0] + i * src_stride[0];
+        const uint8_t *u = vsrc[1] + (i >> vsub) * src_stride[1];
+        const uint8_t *v = vsrc[2] + (i >> vsub) * src_stride[2];
+        uint32_t *d = (uint32_t *)(vdst[0] + i * dst_stride);
+
+        for (j = 0; j < width; j++) {
+            int cy = (y[j] - 16) * 298 + 128;
+            int cu = u[j >> hsub] - 128;
+            int cv = v[j >> hsub] - 128;
+
+            d[j] = clip8((cy + 409 * cv) >> 8) << 16 |
+                   clip8((cy - 100 * cu - 208 * cv) >> 8) << 8 |
+                   clip8((cy + 516 * cu) >> 8);
+        }
+    }
+}
+
+static void yuv2rgb_nop(void)
+{
+}
+
+DRIVER(pixconv, yuv2rgb) = {
+    .name    = "yuv2rgb",
+    .open    = yuv2rgb_open,
+    .convert = yuv2rgb_convert,
+    .finish  = yuv2rgb_nop,
+    .close   = yuv2rgb_nop,
+};